@@ -1,4 +1,5 @@
 #include <tchar.h>
+#include <io.h>
 
 #include <cstdarg>
 #include <cstdio>
@@ -7,6 +8,17 @@
 #include <deque>
 #include <unordered_set>
 #include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
+#include <limits>
+#include <bit>
+#include <span>
 
 #include "sha2.h"
 
@@ -20,1189 +32,7054 @@
 static constexpr TCHAR LogFileName[] = _T("RedistributrLog.log");
 static constexpr TCHAR ListFileName[] = _T("RedistributeList.pr");
 static constexpr TCHAR HashFileName[] = _T("RedistributeHash.pr");
+static constexpr TCHAR JournalFileName[] = _T("RedistributeJournal.pr");
+static constexpr TCHAR StagingSuffix[] = _T(".prtmp");
+static constexpr TCHAR PackFilePrefix[] = _T("RedistributePack");
+static constexpr TCHAR PackFileExtension[] = _T(".pr");
+
+// Longest path Windows accepts at all, the bound for path lengths read back from files.
+static constexpr unsigned int MaxPathLength = 32767;
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-namespace __hidden_Log
+enum class IOBackend : unsigned char
 {
-	static TCHAR TmpString[1 << 16];
-	static std::deque<std::basic_string<TCHAR>> Queue;
-	static FILE* File = nullptr;
+	Sync,
+	Async,
 };
-
-bool CreateLog(const std::filesystem::path& LogPath)
-{
-	std::error_code Error;
-	
-	std::filesystem::remove(LogPath, Error);
-	if(Error)
-	{
-		return false;
-	}
-
-	__hidden_Log::File = nullptr;
-	_tfopen_s(&__hidden_Log::File, LogPath.string<TCHAR>().c_str(), _T("wb"));
-	if (!__hidden_Log::File)
-	{
-		return false;
-	}
-
-	__hidden_Log::Queue.clear();
-	return true;
-}
-void CloseLog()
+// Each level includes the ones above it.
+enum class LogLevel : unsigned char
 {
-	for (const auto& String : __hidden_Log::Queue)
-	{
-		_ftprintf_s(__hidden_Log::File, _T("%s"), String.c_str());
-	}
-	
-	fclose(__hidden_Log::File);
-	__hidden_Log::File = nullptr;
-
-	__hidden_Log::Queue.clear();
-}
-void PushLog(const TCHAR* Format, ...)
+	Error,
+	Summary,
+	File,
+	Trace,
+};
+enum class DedupMode : unsigned char
 {
-	va_list ArgList;
-	va_start(ArgList, Format);
-	_vstprintf_s(__hidden_Log::TmpString, Format, ArgList);
-	va_end(ArgList);
-	
-	__hidden_Log::Queue.emplace_back(__hidden_Log::TmpString);
-	_tprintf_s(_T("%s"), __hidden_Log::TmpString);
-}
-
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
+	None,
+	Clone,
+	Link,
+};
 
-namespace __hidden_File
+namespace __hidden_Option
 {
-	struct Hasher
+	static LogLevel ConsoleLevel = LogLevel::Summary;
+	static LogLevel FileLevel = LogLevel::File;
+	static std::filesystem::path EventPath;
+	static bool bFileEvents = false;
+	static size_t ProgressInterval = 1;
+	static bool bProfile = false;
+	static std::filesystem::path ProfilePath;
+	static std::filesystem::path TracePath;
+	static size_t TraceSpans = 256 * 1024;
+	static std::filesystem::path MetricsPath;
+	static size_t MetricsInterval = 15;
+
+	static size_t BufferBudget = 256 * 1024 * 1024;
+	static size_t BufferSize = 16 * 1024 * 1024;
+	static bool bLargePages = false;
+
+	static IOBackend Backend = IOBackend::Sync;
+	static size_t DirectIOSize = 0;
+	static bool bSyncBatch = true;
+	static size_t ReadLimit = 0;
+	static size_t WriteLimit = 0;
+	static size_t FileLimit = 0;
+	static std::filesystem::path ThrottleFile;
+
+	static size_t PackFileSize = 0;
+	static size_t PackSize = 64 * 1024 * 1024;
+
+	static bool bVerify = false;
+	static size_t VerifyRetry = 2;
+
+	static size_t CheckpointSize = 0;
+
+	static DedupMode Dedup = DedupMode::None;
+
+	static std::filesystem::path StorePath;
+	static size_t KeepVersions = 5;
+	static std::basic_string<TCHAR> RollbackVersion;
+
+	static std::filesystem::path PlanPath;
+	static std::filesystem::path ApplyPath;
+
+	static size_t CopyWorkers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	static size_t SmallFileSize = 64 * 1024;
+	static size_t SmallFileBatch = 32;
+
+	bool ParseLevel(const TCHAR* Str, LogLevel& Level)
 	{
-		size_t operator()(const std::filesystem::path& Val) const noexcept
-		{
-			return std::filesystem::hash_value(Val);
-		}
-	};
-	struct EqualTo{
-		bool operator()(const std::filesystem::path& Lhs, const std::filesystem::path& Rhs) const noexcept
+		static constexpr const TCHAR* Names[] = { _T("error"), _T("summary"), _T("file"), _T("trace") };
+		for (size_t i = 0; i < std::size(Names); ++i)
 		{
-			std::error_code Error;
-			
-			const size_t Val = std::filesystem::equivalent(Lhs, Rhs, Error);
-			if (Error)
+			if (_tcscmp(Str, Names[i]) == 0)
 			{
-				PushLog(_T("!!Error: Error occurred while comparing paths \"%s\" and \"%s\"\n"), Lhs.string<TCHAR>().c_str(), Rhs.string<TCHAR>().c_str());
-				return false;
+				Level = static_cast<LogLevel>(i);
+				return true;
 			}
-			return Val;
 		}
-	};
+		return false;
+	}
 
-	class FileIO
+	// Only plain decimal digits, without the sign and blanks _tcstoull would let through.
+	bool ParseDigits(const TCHAR*& Str, unsigned long long& Parsed)
 	{
-	public:
-		FileIO() : File(nullptr) {}
-		FileIO(const std::filesystem::path& _FilePath, const TCHAR* Mode) : File(nullptr), FilePath(_FilePath)
-		{
-			_tfopen_s(&File, FilePath.string<TCHAR>().c_str(), Mode);
-		}
-		FileIO(std::filesystem::path&& _FilePath, const TCHAR* Mode) : File(nullptr), FilePath(std::move(_FilePath))
-		{
-			_tfopen_s(&File, FilePath.string<TCHAR>().c_str(), Mode);
-		}
-		FileIO(const FileIO& Rhs) = delete; 
-		FileIO(FileIO&& Rhs) noexcept : File(Rhs.File), FilePath(std::move(Rhs.FilePath)) { Rhs.File = nullptr; }
+		static constexpr unsigned long long Max = std::numeric_limits<size_t>::max();
 
-		~FileIO()
+		const TCHAR* Begin = Str;
+		Parsed = 0;
+		for (; (*Str >= _T('0')) && (*Str <= _T('9')); ++Str)
 		{
-			if (File)
+			const unsigned Digit = static_cast<unsigned>(*Str - _T('0'));
+			if (Parsed > ((Max - Digit) / 10))
 			{
-				Close();
+				return false;
 			}
+			Parsed = (Parsed * 10) + Digit;
 		}
+		return Str != Begin;
+	}
 
-	public:
-		FileIO& operator=(const FileIO& Rhs) = delete;
-		FileIO& operator=(FileIO&& Rhs) noexcept
+	bool ParseSize(const TCHAR* Str, size_t& Value)
+	{
+		unsigned long long Parsed = 0;
+		if (!ParseDigits(Str, Parsed))
 		{
-			if (File)
-			{
-				Close();
-			}
-			
-			File = Rhs.File;
-			FilePath = std::move(Rhs.FilePath);
-
-			Rhs.File = nullptr;
-
-			return *this;
+			return false;
 		}
 
-	public:
-		operator bool() const noexcept
-		{
-			return (File != nullptr);
-		}
-		FILE* Get() const noexcept
+		unsigned Shift = 0;
+		switch (*Str)
 		{
-			return File;
+		case _T('k'):
+		case _T('K'):
+			Shift = 10;
+			++Str;
+			break;
+		case _T('m'):
+		case _T('M'):
+			Shift = 20;
+			++Str;
+			break;
+		case _T('g'):
+		case _T('G'):
+			Shift = 30;
+			++Str;
+			break;
 		}
-
-	public:
-		bool CloseWithReturn()
+		if (*Str != _T('\0'))
 		{
-			if (fclose(File))
-			{
-				return false;
-			}
-			File = nullptr;
-			return true;
+			return false;
 		}
-		void Close()
+		if (Parsed > (static_cast<unsigned long long>(std::numeric_limits<size_t>::max()) >> Shift))
 		{
-			if (!CloseWithReturn())
-			{
-				PushLog(_T("!!Error: Failed to close file \"%s\"\n"), FilePath.string<TCHAR>().c_str());
-			}
+			return false;
 		}
-		
-	private:
-		FILE* File;
-		std::filesystem::path FilePath;
-	};
-
-	unsigned char CopyBuffer[1 * 1024 * 1024 * 1024];
-};
-
-typedef __hidden_File::FileIO FilePtr;
-
-using PathSet = std::unordered_set<std::filesystem::path, __hidden_File::Hasher, __hidden_File::EqualTo>;
-template <typename Value>
-using PathMap = std::unordered_map<std::filesystem::path, Value, __hidden_File::Hasher, __hidden_File::EqualTo>;
 
-std::basic_string<TCHAR> ReadFileStringLine(FilePtr& File)
-{
-	std::basic_string<TCHAR> TmpString;
-	while (!feof(File.Get()))
+		Value = static_cast<size_t>(Parsed << Shift);
+		return true;
+	}
+	// Intervals and counts that a unit suffix would only make ambiguous.
+	bool ParseCount(const TCHAR* Str, size_t& Value)
 	{
-		TCHAR Char = _fgettc(File.Get());
-		if (Char == _T('\r'))
-		{
-			continue;
-		}
-		else if (Char == _T('\n'))
-		{
-			break;
-		}
-		else if (Char == static_cast<TCHAR>(-1))
+		unsigned long long Parsed = 0;
+		if (!ParseDigits(Str, Parsed) || (*Str != _T('\0')))
 		{
-			break;
+			return false;
 		}
-		TmpString.push_back(Char);
-	}
 
-	if (TmpString.empty())
-	{
-		return std::filesystem::path();
+		Value = static_cast<size_t>(Parsed);
+		return true;
 	}
+};
 
-	return std::move(TmpString);
-}
-std::filesystem::path ReadFileLine(FilePtr& File)
+bool ParseOption(const TCHAR* Arg)
 {
-	std::error_code Error;
-	
-	std::basic_string<TCHAR> TmpString(ReadFileStringLine(File));
-	if (TmpString.empty())
-	{
-		return std::filesystem::path();
-	}
+	const std::basic_string<TCHAR> Option(Arg);
+	const size_t Separator = Option.find(_T('='));
+	const std::basic_string<TCHAR> Name = Option.substr(0, Separator);
+	const TCHAR* Value = (Separator == std::basic_string<TCHAR>::npos) ? nullptr : (Arg + Separator + 1);
 
-	std::filesystem::path Path = TmpString;
-	Path = std::filesystem::canonical(Path, Error);
-	if (Error)
+	if (Name == _T("--buffer-budget"))
 	{
-		PushLog(_T("!!Error: Error occurred while canonicalizing \"%s\"\n"), TmpString.c_str());
-		return std::filesystem::path();
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::BufferBudget) && (__hidden_Option::BufferBudget > 0);
 	}
-	
-	return std::move(Path);
-}
-std::filesystem::path ReadFileLine(FilePtr& File, bool& bExclude)
-{
-	std::error_code Error;
-	
-	std::basic_string<TCHAR> TmpString(ReadFileStringLine(File));
-	if (TmpString.empty())
+	if (Name == _T("--buffer-size"))
 	{
-		return std::filesystem::path();
+		// A buffer is handed to the hash and to ReadFile/WriteFile in one piece, whose lengths are 32 bits. The limit leaves room for
+		// rounding up to the large page size.
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::BufferSize) && (__hidden_Option::BufferSize > 0) && (__hidden_Option::BufferSize <= (MAXDWORD >> 1) + 1);
 	}
-
-	if (TmpString[0] == _T('~'))
+	if (Name == _T("--large-pages"))
 	{
-		bExclude = true;
-		TmpString = TmpString.substr(1);
+		__hidden_Option::bLargePages = true;
+		return !Value;
 	}
-	else
+	if (Name == _T("--console-level"))
 	{
-		bExclude = false;
+		return Value && __hidden_Option::ParseLevel(Value, __hidden_Option::ConsoleLevel);
 	}
-
-	std::filesystem::path Path = TmpString;
-	Path = std::filesystem::canonical(Path, Error);
-	if (Error)
+	if (Name == _T("--log-level"))
 	{
-		PushLog(_T("!!Error: Error occurred while canonicalizing \"%s\"\n"), TmpString.c_str());
-		return std::filesystem::path();
+		return Value && __hidden_Option::ParseLevel(Value, __hidden_Option::FileLevel);
 	}
-	
-	return std::move(Path);
-}
-
-bool CheckIfFileContained(const std::deque<std::filesystem::path>& Table, const std::filesystem::path& Path)
-{
-	std::error_code Error;
-	
-	for (const auto& Compare : Table)
+	if (Name == _T("--events"))
 	{
-		const bool bIsEqual = std::filesystem::equivalent(Compare, Path, Error);
-		if (Error)
+		if (!Value || (*Value == _T('\0')))
 		{
-			PushLog(_T("!!Error: Error occurred while comparing paths \"%s\" and \"%s\"\n"), Compare.string<TCHAR>().c_str(), Path.string<TCHAR>().c_str());
 			return false;
 		}
-		if (bIsEqual)
-		{
-			return true;
-		}
-
-		auto Lhs = Compare.string<TCHAR>();
-		auto Rhs = Path.string<TCHAR>();
-
-		std::transform(Lhs.begin(), Lhs.end(), Lhs.begin(), ::tolower);
-		std::transform(Rhs.begin(), Rhs.end(), Rhs.begin(), ::tolower);
-
-		if (Rhs.starts_with(Lhs))
-		{
-			return true;
-		}
+		__hidden_Option::EventPath = std::filesystem::absolute(Value);
+		return true;
 	}
-	return false;
-}
-
-bool BufferFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath)
-{
-	std::error_code Error;
-	
-	FilePtr FromFile(FromPath.string<TCHAR>().c_str(), _T("rb"));
-	if (!FromFile)
+	if (Name == _T("--events-files"))
 	{
-		PushLog(_T("!!Error: Cannot open \"%s\"\n"), FromPath.string<TCHAR>().c_str());
-		return false;
+		__hidden_Option::bFileEvents = true;
+		return !Value;
 	}
-
-	bool bShouldCreate = true;
-	const std::filesystem::path ToParentPath = ToPath.parent_path();
-	const bool bExists = std::filesystem::exists(ToParentPath, Error);
-	if (Error)
+	if (Name == _T("--progress"))
 	{
-		PushLog(_T("!!Error: Error occurred while checking if \"%s\" exists\n"), ToParentPath.string<TCHAR>().c_str());
-		return false;
+		return Value && __hidden_Option::ParseCount(Value, __hidden_Option::ProgressInterval);
 	}
-	if (bExists)
+	if (Name == _T("--profile"))
 	{
-		const bool bIsDirectory = std::filesystem::is_directory(ToParentPath, Error);
-		if (Error)
+		__hidden_Option::bProfile = true;
+		return !Value;
+	}
+	if (Name == _T("--profile-json"))
+	{
+		if (!Value || (*Value == _T('\0')))
 		{
-			PushLog(_T("!!Error: Error occurred while checking if \"%s\" is a directory\n"), ToParentPath.string<TCHAR>().c_str());
 			return false;
 		}
-		if (bIsDirectory)
+		__hidden_Option::bProfile = true;
+		__hidden_Option::ProfilePath = std::filesystem::absolute(Value);
+		return true;
+	}
+	if (Name == _T("--trace"))
+	{
+		if (!Value || (*Value == _T('\0')))
 		{
-			bShouldCreate = false;
+			return false;
 		}
+		__hidden_Option::TracePath = std::filesystem::absolute(Value);
+		return true;
 	}
-	if (bShouldCreate)
+	if (Name == _T("--trace-spans"))
 	{
-		const bool bCreateDirectory = std::filesystem::create_directories(ToParentPath, Error);
-		if (Error)
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::TraceSpans);
+	}
+	if (Name == _T("--metrics"))
+	{
+		if (!Value || (*Value == _T('\0')))
 		{
-			PushLog(_T("!!Error: Error occurred while creating directory \"%s\"\n"), ToParentPath.string<TCHAR>().c_str());
 			return false;
 		}
-		if (!bCreateDirectory)
+		__hidden_Option::MetricsPath = std::filesystem::absolute(Value);
+		return true;
+	}
+	if (Name == _T("--metrics-interval"))
+	{
+		return Value && __hidden_Option::ParseCount(Value, __hidden_Option::MetricsInterval);
+	}
+	if (Name == _T("--io-backend"))
+	{
+		if (Value && (_tcscmp(Value, _T("sync")) == 0))
 		{
-			PushLog(_T("!!Error: Failed to create directory \"%s\"\n"), ToParentPath.string<TCHAR>().c_str());
-			return false;
+			__hidden_Option::Backend = IOBackend::Sync;
+			return true;
+		}
+		if (Value && (_tcscmp(Value, _T("async")) == 0))
+		{
+			__hidden_Option::Backend = IOBackend::Async;
+			return true;
 		}
+		return false;
 	}
-
-	FilePtr ToFile(ToPath.string<TCHAR>().c_str(), _T("wb"));
-	if (!ToFile)
+	if (Name == _T("--direct-io"))
 	{
-		PushLog(_T("!!Error: Cannot open \"%s\"\n"), ToPath.string<TCHAR>().c_str());
-		return false;
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::DirectIOSize);
 	}
-
-	while (const size_t ReadSize = fread_s(__hidden_File::CopyBuffer, sizeof(__hidden_File::CopyBuffer), sizeof(unsigned char), sizeof(__hidden_File::CopyBuffer), FromFile.Get()))
+	if (Name == _T("--sync"))
 	{
-		if (ReadSize <= 0)
+		if (Value && (_tcscmp(Value, _T("none")) == 0))
 		{
+			__hidden_Option::bSyncBatch = false;
 			return true;
 		}
-
-		if (fwrite(__hidden_File::CopyBuffer, sizeof(unsigned char), ReadSize, ToFile.Get()) != ReadSize)
+		if (Value && (_tcscmp(Value, _T("batch")) == 0))
+		{
+			__hidden_Option::bSyncBatch = true;
+			return true;
+		}
+		return false;
+	}
+	if (Name == _T("--read-limit"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::ReadLimit);
+	}
+	if (Name == _T("--write-limit"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::WriteLimit);
+	}
+	if (Name == _T("--file-limit"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::FileLimit);
+	}
+	if (Name == _T("--throttle-file"))
+	{
+		if (!Value || (*Value == _T('\0')))
 		{
-			PushLog(_T("!!Error: Failed to write \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
 			return false;
 		}
+		__hidden_Option::ThrottleFile = std::filesystem::absolute(Value);
+		return true;
 	}
-
-	if (!FromFile.CloseWithReturn())
+	if (Name == _T("--pack"))
 	{
-		PushLog(_T("!!Error: Cannot close file \"%s\"\n"), FromPath.string<TCHAR>().c_str());
-		return false;
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::PackFileSize);
 	}
-	if (!ToFile.CloseWithReturn())
+	if (Name == _T("--pack-size"))
 	{
-		PushLog(_T("!!Error: Cannot close file \"%s\"\n"), ToPath.string<TCHAR>().c_str());
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::PackSize) && (__hidden_Option::PackSize > 0);
+	}
+	if (Name == _T("--verify"))
+	{
+		__hidden_Option::bVerify = true;
+		return !Value;
+	}
+	if (Name == _T("--verify-retry"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::VerifyRetry);
+	}
+	if (Name == _T("--checkpoint"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::CheckpointSize);
+	}
+	if (Name == _T("--dedup"))
+	{
+		if (Value && (_tcscmp(Value, _T("none")) == 0))
+		{
+			__hidden_Option::Dedup = DedupMode::None;
+			return true;
+		}
+		if (Value && (_tcscmp(Value, _T("clone")) == 0))
+		{
+			__hidden_Option::Dedup = DedupMode::Clone;
+			return true;
+		}
+		if (Value && (_tcscmp(Value, _T("link")) == 0))
+		{
+			__hidden_Option::Dedup = DedupMode::Link;
+			return true;
+		}
 		return false;
 	}
-
-	return true;
+	if (Name == _T("--store"))
+	{
+		if (!Value || (*Value == _T('\0')))
+		{
+			return false;
+		}
+		// The store is told apart from deployed files by its path, which has to be spelled the way the canonical destination is.
+		std::error_code Error;
+		__hidden_Option::StorePath = std::filesystem::weakly_canonical(std::filesystem::absolute(Value), Error);
+		if (Error)
+		{
+			__hidden_Option::StorePath = std::filesystem::absolute(Value);
+		}
+		return true;
+	}
+	if (Name == _T("--keep-versions"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::KeepVersions) && (__hidden_Option::KeepVersions > 0);
+	}
+	if (Name == _T("--rollback"))
+	{
+		if (!Value || (*Value == _T('\0')))
+		{
+			return false;
+		}
+		__hidden_Option::RollbackVersion = Value;
+		return true;
+	}
+	if (Name == _T("--plan"))
+	{
+		if (!Value || (*Value == _T('\0')))
+		{
+			return false;
+		}
+		__hidden_Option::PlanPath = std::filesystem::absolute(Value);
+		return true;
+	}
+	if (Name == _T("--apply"))
+	{
+		if (!Value || (*Value == _T('\0')))
+		{
+			return false;
+		}
+		__hidden_Option::ApplyPath = std::filesystem::absolute(Value);
+		return true;
+	}
+	if (Name == _T("--copy-workers"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::CopyWorkers) && (__hidden_Option::CopyWorkers > 0);
+	}
+	if (Name == _T("--small-file"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::SmallFileSize);
+	}
+	if (Name == _T("--small-batch"))
+	{
+		return Value && __hidden_Option::ParseSize(Value, __hidden_Option::SmallFileBatch) && (__hidden_Option::SmallFileBatch > 0);
+	}
+	return false;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-struct RawHash
-{
-	unsigned char Raw[512];
-};
-
-namespace __hidden_Hash
+namespace __hidden_Log
 {
-	static constexpr size_t ReadHashSize = 100 * 1024 * 1024;
-	static unsigned char TmpMover[__hidden_Hash::ReadHashSize];
-};
+	// Messages pass through a bounded multi-producer ring drained by one writer thread. Short messages are kept inside their slot and only
+	// the rare long one is copied to the heap, so memory stays at SlotCount slots however long the run is. A producer only waits when the
+	// writer is a whole ring behind.
+	static constexpr size_t SlotCount = 4096;
+	static constexpr size_t InlineLength = 512;
 
-void ConvertToHash(FilePtr& File, RawHash& Hash)
-{
-	sha512_ctx CTX;
-	sha512_init(&CTX);
-	
-	while (const size_t Read = fread_s(__hidden_Hash::TmpMover, __hidden_Hash::ReadHashSize, sizeof(unsigned char), __hidden_Hash::ReadHashSize, File.Get()))
+	struct Slot
 	{
-		sha512_update(&CTX, __hidden_Hash::TmpMover, static_cast<unsigned int>(Read));
-	}
-	
-	sha512_final(&CTX, Hash.Raw);
-}
-std::basic_string<TCHAR> ConvertToString(const RawHash& Hash)
-{
-	static constexpr size_t Len = sizeof(RawHash::Raw) << 1;
-	static constexpr TCHAR Digits[] = _T("0123456789abcdef");
-	std::basic_string<TCHAR> TmpString(Len, _T('0'));
+		std::atomic<size_t> Sequence;
+		LogLevel Level;
+		TCHAR* Overflow;
+		TCHAR Inline[InlineLength];
+	};
 
-	for(size_t i = 0; i < (Len >> 1); ++i)
-	{
-		TmpString[(i << 1) + 0] = Digits[(Hash.Raw[i] >> 4) & 0x0f];
-		TmpString[(i << 1) + 1] = Digits[(Hash.Raw[i] >> 0) & 0x0f];
-	}
+	static Slot Ring[SlotCount];
+	static std::atomic<size_t> EnqueuePos = 0;
+	static size_t DequeuePos = 0;
 
-	return std::move(TmpString);
-}
-bool ConvertToHash(const std::basic_string<TCHAR>& Str, RawHash& Hash)
-{
-	if (Str.length() < (sizeof(RawHash::Raw) << 1))
-		return false;
-	
-	for (size_t i = 0; i < (sizeof(RawHash::Raw) << 1); ++i)
+	static std::thread Writer;
+	static std::atomic<bool> bRunning = false;
+	static std::atomic<bool> bStopping = false;
+	static std::mutex FallbackMutex;
+	static FILE* File = nullptr;
+
+	static thread_local TCHAR TmpString[1 << 16];
+
+	// File messages the console does not show are counted instead, and the count is printed about once a second.
+	static size_t HiddenCount = 0;
+	static size_t ReportedCount = 0;
+	static std::atomic<size_t> SkippedCount = 0;
+	static size_t SkippedBase = 0;
+	static std::chrono::steady_clock::time_point LastReport;
+
+	// Set while a progress reporter prints its own lines, which already cover the count.
+	static std::atomic<bool> bProgressActive = false;
+
+	// Calls without an explicit level are classified by their format: "!!" errors and warnings, "*" summary lines and everything else
+	// as file messages.
+	LogLevel GuessLevel(const TCHAR* Format)
 	{
-		TCHAR Char = Str[i];
-		if (Char >= _T('0') && Char <= _T('9'))
+		if (_tcsncmp(Format, _T("!!"), 2) == 0)
 		{
-			Char -= _T('0');
+			return LogLevel::Error;
 		}
-		else if (Char >= _T('a') && Char <= _T('f'))
+		if ((Format[0] == _T('*')) || ((Format[0] == _T('\n')) && (Format[1] == _T('*'))))
 		{
-			Char -= _T('a') - 10;
+			return LogLevel::Summary;
 		}
-		else if (Char >= _T('A') && Char <= _T('F'))
+		return LogLevel::File;
+	}
+	bool IsWanted(LogLevel Level)
+	{
+		return (Level <= __hidden_Option::ConsoleLevel) || (Level <= __hidden_Option::FileLevel);
+	}
+
+	void Enqueue(LogLevel Level, const TCHAR* Text, size_t Length)
+	{
+		size_t Pos = EnqueuePos.load(std::memory_order_relaxed);
+		for (;;)
 		{
-			Char -= _T('A') - 10;
+			Slot& Cur = Ring[Pos % SlotCount];
+			const size_t Sequence = Cur.Sequence.load(std::memory_order_acquire);
+			if (Sequence == Pos)
+			{
+				if (EnqueuePos.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed))
+				{
+					Cur.Level = Level;
+					if (Length < InlineLength)
+					{
+						memcpy(Cur.Inline, Text, (Length + 1) * sizeof(TCHAR));
+						Cur.Overflow = nullptr;
+					}
+					else
+					{
+						Cur.Overflow = new TCHAR[Length + 1];
+						memcpy(Cur.Overflow, Text, (Length + 1) * sizeof(TCHAR));
+					}
+					Cur.Sequence.store(Pos + 1, std::memory_order_release);
+					return;
+				}
+			}
+			else if (Sequence < Pos)
+			{
+				std::this_thread::yield();
+				Pos = EnqueuePos.load(std::memory_order_relaxed);
+			}
+			else
+			{
+				Pos = EnqueuePos.load(std::memory_order_relaxed);
+			}
 		}
-		else
+	}
+
+	// Writes the oldest message to the file and the console, returns false when there is none.
+	bool WriteNext()
+	{
+		Slot& Cur = Ring[DequeuePos % SlotCount];
+		if (Cur.Sequence.load(std::memory_order_acquire) != (DequeuePos + 1))
 		{
-			Char = 0;
+			return false;
 		}
 
-		if (i & 1)
+		const TCHAR* Text = Cur.Overflow ? Cur.Overflow : Cur.Inline;
+		if (Cur.Level <= __hidden_Option::FileLevel)
 		{
-			Hash.Raw[i >> 1] |= Char;
+			_ftprintf_s(File, _T("%s"), Text);
 		}
-		else
+		if (Cur.Level <= __hidden_Option::ConsoleLevel)
 		{
-			Hash.Raw[i >> 1] = Char << 4;
+			// A new phase starts its own count.
+			if ((Text[0] == _T('\n')) && (Text[1] == _T('*')))
+			{
+				HiddenCount = 0;
+				ReportedCount = 0;
+				SkippedBase = SkippedCount.load(std::memory_order_relaxed);
+			}
+			_tprintf_s(_T("%s"), Text);
+		}
+		else if (Cur.Level == LogLevel::File)
+		{
+			++HiddenCount;
 		}
+
+		delete[] Cur.Overflow;
+		Cur.Overflow = nullptr;
+
+		Cur.Sequence.store(DequeuePos + SlotCount, std::memory_order_release);
+		++DequeuePos;
+		return true;
 	}
 
-	return true;
-}
+	void Run()
+	{
+		for (;;)
+		{
+			// Everything pushed before the stop request is drained before the thread ends.
+			const bool bStop = bStopping.load(std::memory_order_acquire);
 
+			bool bWrote = false;
+			while (WriteNext())
+			{
+				bWrote = true;
+			}
+			if (bStop)
+			{
+				break;
+			}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			if (bWrote)
+			{
+				fflush(File);
+			}
+			else
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			}
 
+			const auto CurTime = std::chrono::steady_clock::now();
+			const size_t ProcessedCount = HiddenCount + (SkippedCount.load(std::memory_order_relaxed) - SkippedBase);
+			if (bProgressActive.load(std::memory_order_relaxed))
+			{
+				ReportedCount = ProcessedCount;
+			}
+			else if ((ProcessedCount != ReportedCount) && ((CurTime - LastReport) >= std::chrono::seconds(1)))
+			{
+				_tprintf_s(_T("... %u file(s) processed\n"), static_cast<unsigned>(ProcessedCount));
+				ReportedCount = ProcessedCount;
+				LastReport = CurTime;
+			}
+		}
+		fflush(File);
+	}
+};
 
-void CreateHash(const std::filesystem::path& SrcPath)
+bool CreateLog(const std::filesystem::path& LogPath)
 {
 	std::error_code Error;
 	
-	PathSet PathsToExclude;
-	std::deque<std::filesystem::path> PathsToHashMaking;
-	
-	const std::filesystem::path ListPath(SrcPath / ListFileName);
-	FilePtr ListFile(ListPath, _T("rt, ccs=UTF-8"));
-	if (!ListFile)
+	std::filesystem::remove(LogPath, Error);
+	if(Error)
 	{
-		PushLog(_T("!!Error: Cannot open \"%s\"\n"), ListPath.string<TCHAR>().c_str());
-		return;
+		return false;
 	}
 
-	const std::filesystem::path HashPath(SrcPath / HashFileName);
-	std::filesystem::remove(HashPath, Error);
-	if (Error)
+	__hidden_Log::File = nullptr;
+	_tfopen_s(&__hidden_Log::File, LogPath.string<TCHAR>().c_str(), _T("wb"));
+	if (!__hidden_Log::File)
 	{
-		PushLog(_T("!!Error: Cannot delete \"%s\"\n"), HashPath.string<TCHAR>().c_str());
-		return;
+		return false;
+	}
+
+	for (size_t i = 0; i < __hidden_Log::SlotCount; ++i)
+	{
+		__hidden_Log::Ring[i].Sequence.store(i, std::memory_order_relaxed);
+		__hidden_Log::Ring[i].Overflow = nullptr;
+	}
+	__hidden_Log::EnqueuePos = 0;
+	__hidden_Log::DequeuePos = 0;
+	__hidden_Log::HiddenCount = 0;
+	__hidden_Log::ReportedCount = 0;
+	__hidden_Log::SkippedCount = 0;
+	__hidden_Log::SkippedBase = 0;
+	__hidden_Log::LastReport = std::chrono::steady_clock::now();
+
+	__hidden_Log::bStopping = false;
+	__hidden_Log::Writer = std::thread(__hidden_Log::Run);
+	__hidden_Log::bRunning = true;
+	return true;
+}
+void CloseLog()
+{
+	__hidden_Log::bRunning = false;
+	__hidden_Log::bStopping = true;
+	if (__hidden_Log::Writer.joinable())
+	{
+		__hidden_Log::Writer.join();
 	}
 	
-	FilePtr HashFile(HashPath, _T("wt, ccs=UTF-8"));
-	if (!HashFile)
+	fclose(__hidden_Log::File);
+	__hidden_Log::File = nullptr;
+}
+void PushLogV(LogLevel Level, const TCHAR* Format, va_list ArgList)
+{
+	// Messages no sink takes are dropped before they are formatted, file messages still count towards the progress.
+	if (!__hidden_Log::IsWanted(Level))
 	{
-		PushLog(_T("!!Error: Cannot open \"%s\"\n"), HashPath.string<TCHAR>().c_str());
+		if (Level == LogLevel::File)
+		{
+			__hidden_Log::SkippedCount.fetch_add(1, std::memory_order_relaxed);
+		}
 		return;
 	}
 
-	size_t TotalErrorCount = 0;
+	const int Length = _vstprintf_s(__hidden_Log::TmpString, Format, ArgList);
+	if (Length <= 0)
+	{
+		return;
+	}
 
+	// Without a log file, as while parsing arguments, messages go straight to the console.
+	if (!__hidden_Log::bRunning.load(std::memory_order_acquire))
 	{
-		PushLog(_T("\n* Read file list to making hash:\n"));
-		size_t LocalErrorCount = 0;
-		
-		SetCurrentDirectory(SrcPath.string<TCHAR>().c_str());
-		while (!feof(ListFile.Get()))
+		if (Level <= __hidden_Option::ConsoleLevel)
 		{
-			bool bExclude;
-			std::filesystem::path CurPath(ReadFileLine(ListFile, bExclude));
-			if (CurPath.empty())
-			{
-				continue;
-			}
-			const bool bExists = std::filesystem::exists(CurPath, Error);
-			if (Error)
-			{
-				PushLog(_T("!!Error: Cannot check the existence of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
-			}
-			if (!bExists)
-			{
+			std::lock_guard<std::mutex> Lock(__hidden_Log::FallbackMutex);
+			_tprintf_s(_T("%s"), __hidden_Log::TmpString);
+		}
+		return;
+	}
+
+	__hidden_Log::Enqueue(Level, __hidden_Log::TmpString, static_cast<size_t>(Length));
+}
+void PushLog(LogLevel Level, const TCHAR* Format, ...)
+{
+	va_list ArgList;
+	va_start(ArgList, Format);
+	PushLogV(Level, Format, ArgList);
+	va_end(ArgList);
+}
+void PushLog(const TCHAR* Format, ...)
+{
+	va_list ArgList;
+	va_start(ArgList, Format);
+	PushLogV(__hidden_Log::GuessLevel(Format), Format, ArgList);
+	va_end(ArgList);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Quoted JSON string of "Text" in UTF-8.
+void AppendJsonString(std::string& Out, const std::basic_string<TCHAR>& Text)
+{
+	const std::u8string Encoded = std::filesystem::path(Text).u8string();
+
+	Out.push_back('"');
+	for (const char8_t Char : Encoded)
+	{
+		switch (Char)
+		{
+		case u8'"':
+			Out += "\\\"";
+			break;
+		case u8'\\':
+			Out += "\\\\";
+			break;
+		default:
+			if (Char < 0x20)
+			{
+				char Escaped[8];
+				snprintf(Escaped, sizeof(Escaped), "\\u%04x", static_cast<unsigned>(Char));
+				Out += Escaped;
+			}
+			else
+			{
+				Out.push_back(static_cast<char>(Char));
+			}
+			break;
+		}
+	}
+	Out.push_back('"');
+}
+
+
+namespace __hidden_Trace
+{
+	// Spans with an id overlap others of the same thread, as the files in flight of the async backend do, and are written as async events.
+	struct Span
+	{
+		const char* Name;
+		const char* Category;
+		std::chrono::steady_clock::time_point StartTime;
+		std::chrono::steady_clock::time_point EndTime;
+		size_t AsyncId;
+		std::basic_string<TCHAR> Detail;
+	};
+
+	// Every thread appends to its own buffer only. Buffers are linked into a list once and kept until the process ends,
+	// so the spans of threads that are gone by the time the trace is written are not lost.
+	struct ThreadBuffer
+	{
+		unsigned long ThreadId;
+		std::vector<Span> Spans;
+		ThreadBuffer* Next;
+	};
+
+	static std::atomic<ThreadBuffer*> Head = nullptr;
+	static std::atomic<size_t> NextAsyncId = 1;
+
+	// Spans are held until the end of the run, so their number is bounded by "--trace-spans". Later spans are only counted.
+	static std::atomic<size_t> SpanCount = 0;
+	static const std::chrono::steady_clock::time_point Epoch = std::chrono::steady_clock::now();
+
+	ThreadBuffer& GetBuffer()
+	{
+		static thread_local ThreadBuffer* Buffer = nullptr;
+		if (!Buffer)
+		{
+			Buffer = new ThreadBuffer{ GetCurrentThreadId(), {}, Head.load(std::memory_order_relaxed) };
+			while (!Head.compare_exchange_weak(Buffer->Next, Buffer, std::memory_order_release, std::memory_order_relaxed));
+		}
+		return *Buffer;
+	}
+
+	void AppendEvent(std::string& Out, const char* Phase, const Span& Source, unsigned long ThreadId, long long Timestamp, long long Duration)
+	{
+		char Record[256];
+		snprintf(Record, sizeof(Record), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%lld,\"pid\":1,\"tid\":%lu", Source.Name, Source.Category, Phase, Timestamp, ThreadId);
+		Out += Record;
+		if (Duration >= 0)
+		{
+			Out += ",\"dur\":" + std::to_string(Duration);
+		}
+		if (Source.AsyncId > 0)
+		{
+			Out += ",\"id\":" + std::to_string(Source.AsyncId);
+		}
+		if (!Source.Detail.empty())
+		{
+			Out += ",\"args\":{\"path\":";
+			AppendJsonString(Out, Source.Detail);
+			Out += "}";
+		}
+		Out += "},\n";
+	}
+};
+
+bool IsTraceEnabled()
+{
+	return !__hidden_Option::TracePath.empty();
+}
+
+// Callers check IsTraceEnabled first, recording never blocks and never takes a lock.
+void RecordTraceSpan(const char* Name, const char* Category, std::chrono::steady_clock::time_point StartTime, std::basic_string<TCHAR>&& Detail, bool bAsync = false)
+{
+	if ((__hidden_Option::TraceSpans > 0) && (__hidden_Trace::SpanCount.fetch_add(1, std::memory_order_relaxed) >= __hidden_Option::TraceSpans))
+	{
+		return;
+	}
+	__hidden_Trace::GetBuffer().Spans.emplace_back(__hidden_Trace::Span{ Name, Category, StartTime, std::chrono::steady_clock::now(), bAsync ? __hidden_Trace::NextAsyncId.fetch_add(1, std::memory_order_relaxed) : 0, std::move(Detail) });
+}
+
+// Records the lifetime of the scope as one span when "--trace" is given.
+class TraceScope
+{
+public:
+	TraceScope(const char* _Name, const char* _Category) : Name(_Name), Category(_Category), bEnabled(IsTraceEnabled())
+	{
+		if (bEnabled)
+		{
+			StartTime = std::chrono::steady_clock::now();
+		}
+	}
+	TraceScope(const char* _Name, const char* _Category, const std::filesystem::path& Path) : TraceScope(_Name, _Category)
+	{
+		SetDetail(Path);
+	}
+	TraceScope(const TraceScope& Rhs) = delete;
+
+	~TraceScope()
+	{
+		if (bEnabled)
+		{
+			RecordTraceSpan(Name, Category, StartTime, std::move(Detail));
+		}
+	}
+
+public:
+	TraceScope& operator=(const TraceScope& Rhs) = delete;
+
+public:
+	void SetDetail(const std::filesystem::path& Path)
+	{
+		if (bEnabled)
+		{
+			Detail = Path.string<TCHAR>();
+		}
+	}
+
+private:
+	const char* Name;
+	const char* Category;
+	bool bEnabled;
+	std::chrono::steady_clock::time_point StartTime;
+	std::basic_string<TCHAR> Detail;
+};
+
+// Must run after every worker has finished, the buffers are read without synchronizing with their threads.
+bool WriteTrace()
+{
+	if (!IsTraceEnabled())
+	{
+		return true;
+	}
+
+	FILE* File = nullptr;
+	_tfopen_s(&File, __hidden_Option::TracePath.string<TCHAR>().c_str(), _T("wb"));
+	if (!File)
+	{
+		return false;
+	}
+
+	bool bWritten = fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", File) >= 0;
+
+	std::string Text;
+	for (const __hidden_Trace::ThreadBuffer* Buffer = __hidden_Trace::Head.load(std::memory_order_acquire); Buffer; Buffer = Buffer->Next)
+	{
+		Text.clear();
+		for (const auto& Source : Buffer->Spans)
+		{
+			const long long Start = std::chrono::duration_cast<std::chrono::microseconds>(Source.StartTime - __hidden_Trace::Epoch).count();
+			const long long End = std::chrono::duration_cast<std::chrono::microseconds>(Source.EndTime - __hidden_Trace::Epoch).count();
+			if (Source.AsyncId > 0)
+			{
+				__hidden_Trace::AppendEvent(Text, "b", Source, Buffer->ThreadId, Start, -1);
+				__hidden_Trace::AppendEvent(Text, "e", Source, Buffer->ThreadId, End, -1);
+			}
+			else
+			{
+				__hidden_Trace::AppendEvent(Text, "X", Source, Buffer->ThreadId, Start, End - Start);
+			}
+		}
+		bWritten = bWritten && (fwrite(Text.data(), sizeof(char), Text.size(), File) == Text.size());
+	}
+
+	const size_t SpanCount = __hidden_Trace::SpanCount.load(std::memory_order_relaxed);
+	if ((__hidden_Option::TraceSpans > 0) && (SpanCount > __hidden_Option::TraceSpans))
+	{
+		PushLog(_T("* Trace: %llu span(s) dropped beyond \"--trace-spans\"\n"), static_cast<unsigned long long>(SpanCount - __hidden_Option::TraceSpans));
+	}
+
+	// A closing metadata record keeps the array valid after the trailing comma of the last span.
+	bWritten = bWritten && (fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"PackageRedistributor\"}}\n]}\n", File) >= 0);
+	return (fclose(File) == 0) && bWritten;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+enum class MetricCounter : unsigned char
+{
+	Scanned,
+	Hashed,
+	Copied,
+	Deleted,
+};
+
+namespace __hidden_Metrics
+{
+	static constexpr const char* CounterNames[] = { "scanned", "hashed", "copied", "deleted" };
+
+	struct PhaseRecord
+	{
+		std::string Name;
+		double Seconds;
+		size_t FileCount;
+		uintmax_t ByteCount;
+		size_t ErrorCount;
+	};
+	struct MethodRecord
+	{
+		std::basic_string<TCHAR> Name;
+		size_t FileCount;
+		uintmax_t ByteCount;
+	};
+
+	static std::atomic<uint64_t> FileCounts[std::size(CounterNames)] = {};
+	static std::atomic<uint64_t> ByteCounts[std::size(CounterNames)] = {};
+
+	// Phases and copy methods are recorded when they end, which is rare enough for a lock.
+	static std::mutex Mutex;
+	static std::vector<PhaseRecord> Phases;
+	static std::vector<MethodRecord> Methods;
+
+	static const char* Mode = "";
+	static long long StartTimestamp = 0;
+
+	static std::thread Writer;
+	static std::mutex WriterMutex;
+	static std::condition_variable Wakeup;
+	static bool bStopping = false;
+
+	void AppendMetric(std::string& Out, const char* Name, const char* Type, const char* Help)
+	{
+		Out += "# HELP package_redistributor_";
+		Out += Name;
+		Out += " ";
+		Out += Help;
+		Out += "\n# TYPE package_redistributor_";
+		Out += Name;
+		Out += " ";
+		Out += Type;
+		Out += "\n";
+	}
+	void AppendSample(std::string& Out, const char* Name, const std::string& Labels, double Value)
+	{
+		char Text[64];
+		snprintf(Text, sizeof(Text), "%.17g", Value);
+
+		Out += "package_redistributor_";
+		Out += Name;
+		Out += "{mode=\"";
+		Out += Mode;
+		Out += "\"";
+		Out += Labels;
+		Out += "} ";
+		Out += Text;
+		Out += "\n";
+	}
+
+	std::string Format(bool bFinished)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+
+		std::string Out;
+
+		AppendMetric(Out, "files_total", "counter", "Files scanned, hashed, copied or deleted by the run.");
+		for (size_t i = 0; i < std::size(CounterNames); ++i)
+		{
+			AppendSample(Out, "files_total", std::string(",op=\"") + CounterNames[i] + "\"", static_cast<double>(FileCounts[i].load(std::memory_order_relaxed)));
+		}
+		AppendMetric(Out, "bytes_total", "counter", "Bytes hashed or copied by the run.");
+		for (size_t i = 0; i < std::size(CounterNames); ++i)
+		{
+			AppendSample(Out, "bytes_total", std::string(",op=\"") + CounterNames[i] + "\"", static_cast<double>(ByteCounts[i].load(std::memory_order_relaxed)));
+		}
+
+		AppendMetric(Out, "phase_duration_seconds", "gauge", "Duration of each finished phase.");
+		for (const auto& Phase : Phases)
+		{
+			AppendSample(Out, "phase_duration_seconds", ",phase=\"" + Phase.Name + "\"", Phase.Seconds);
+		}
+		AppendMetric(Out, "phase_files", "gauge", "Files handled by each finished phase.");
+		for (const auto& Phase : Phases)
+		{
+			AppendSample(Out, "phase_files", ",phase=\"" + Phase.Name + "\"", static_cast<double>(Phase.FileCount));
+		}
+		AppendMetric(Out, "phase_bytes", "gauge", "Bytes handled by each finished phase.");
+		for (const auto& Phase : Phases)
+		{
+			AppendSample(Out, "phase_bytes", ",phase=\"" + Phase.Name + "\"", static_cast<double>(Phase.ByteCount));
+		}
+		AppendMetric(Out, "phase_errors", "gauge", "Errors of each finished phase.");
+		for (const auto& Phase : Phases)
+		{
+			AppendSample(Out, "phase_errors", ",phase=\"" + Phase.Name + "\"", static_cast<double>(Phase.ErrorCount));
+		}
+
+		AppendMetric(Out, "copy_method_files", "gauge", "Files copied by each copy method.");
+		for (const auto& Method : Methods)
+		{
+			const std::u8string Name = std::filesystem::path(Method.Name).u8string();
+			AppendSample(Out, "copy_method_files", ",method=\"" + std::string(Name.begin(), Name.end()) + "\"", static_cast<double>(Method.FileCount));
+		}
+		AppendMetric(Out, "copy_method_bytes", "gauge", "Bytes copied by each copy method.");
+		for (const auto& Method : Methods)
+		{
+			const std::u8string Name = std::filesystem::path(Method.Name).u8string();
+			AppendSample(Out, "copy_method_bytes", ",method=\"" + std::string(Name.begin(), Name.end()) + "\"", static_cast<double>(Method.ByteCount));
+		}
+
+		// The "total" phase only ends with the run, its errors decide whether the run succeeded.
+		auto Total = std::find_if(Phases.begin(), Phases.end(), [](const PhaseRecord& Phase) { return Phase.Name == "total"; });
+
+		AppendMetric(Out, "run_start_timestamp_seconds", "gauge", "Unix time the run started.");
+		AppendSample(Out, "run_start_timestamp_seconds", "", static_cast<double>(StartTimestamp));
+		AppendMetric(Out, "run_in_progress", "gauge", "1 while the run is still going.");
+		AppendSample(Out, "run_in_progress", "", bFinished ? 0.0 : 1.0);
+		AppendMetric(Out, "run_success", "gauge", "1 when the finished run had no error.");
+		AppendSample(Out, "run_success", "", (bFinished && (Total != Phases.end()) && (Total->ErrorCount <= 0)) ? 1.0 : 0.0);
+
+		return Out;
+	}
+
+	// The collector may read at any moment, so the file is written aside and renamed over the old one.
+	bool Write(bool bFinished)
+	{
+		const std::string Text = Format(bFinished);
+
+		std::filesystem::path TmpPath = __hidden_Option::MetricsPath;
+		TmpPath += StagingSuffix;
+
+		FILE* File = nullptr;
+		_tfopen_s(&File, TmpPath.string<TCHAR>().c_str(), _T("wb"));
+		if (!File)
+		{
+			return false;
+		}
+		const bool bWritten = fwrite(Text.data(), sizeof(char), Text.size(), File) == Text.size();
+		if ((fclose(File) != 0) || !bWritten)
+		{
+			DeleteFile(TmpPath.string<TCHAR>().c_str());
+			return false;
+		}
+		return MoveFileEx(TmpPath.string<TCHAR>().c_str(), __hidden_Option::MetricsPath.string<TCHAR>().c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+	}
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> Lock(WriterMutex);
+		while (!Wakeup.wait_for(Lock, std::chrono::seconds(__hidden_Option::MetricsInterval), [] { return bStopping; }))
+		{
+			Write(false);
+		}
+	}
+};
+
+bool IsMetricsEnabled()
+{
+	return !__hidden_Option::MetricsPath.empty();
+}
+
+// Lock free, workers call it for every file.
+void CountMetric(MetricCounter Counter, size_t FileCount, uintmax_t ByteCount)
+{
+	__hidden_Metrics::FileCounts[static_cast<size_t>(Counter)].fetch_add(FileCount, std::memory_order_relaxed);
+	__hidden_Metrics::ByteCounts[static_cast<size_t>(Counter)].fetch_add(ByteCount, std::memory_order_relaxed);
+}
+void RecordPhaseMetric(const char* Name, double Seconds, size_t FileCount, uintmax_t ByteCount, size_t ErrorCount)
+{
+	if (!IsMetricsEnabled())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> Lock(__hidden_Metrics::Mutex);
+	__hidden_Metrics::Phases.emplace_back(__hidden_Metrics::PhaseRecord{ Name, Seconds, FileCount, ByteCount, ErrorCount });
+}
+void RecordCopyMethodMetric(const TCHAR* Name, size_t FileCount, uintmax_t ByteCount)
+{
+	if (!IsMetricsEnabled())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> Lock(__hidden_Metrics::Mutex);
+	__hidden_Metrics::Methods.emplace_back(__hidden_Metrics::MethodRecord{ Name, FileCount, ByteCount });
+}
+
+void StartMetrics(const char* Mode)
+{
+	if (!IsMetricsEnabled())
+	{
+		return;
+	}
+
+	__hidden_Metrics::Mode = Mode;
+	__hidden_Metrics::StartTimestamp = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	if (__hidden_Option::MetricsInterval > 0)
+	{
+		__hidden_Metrics::bStopping = false;
+		__hidden_Metrics::Writer = std::thread(__hidden_Metrics::Run);
+	}
+}
+// Stops the periodic writer and writes the final state of the run.
+bool StopMetrics()
+{
+	if (!IsMetricsEnabled())
+	{
+		return true;
+	}
+
+	if (__hidden_Metrics::Writer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> Lock(__hidden_Metrics::WriterMutex);
+			__hidden_Metrics::bStopping = true;
+		}
+		__hidden_Metrics::Wakeup.notify_all();
+		__hidden_Metrics::Writer.join();
+	}
+	return __hidden_Metrics::Write(true);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Optional machine readable counterpart of the log: one JSON object per line, either a "phase" record or, with "--events-files", a
+// "file" record. Timestamps are milliseconds since the Unix epoch, durations are milliseconds.
+namespace __hidden_Event
+{
+	static std::mutex Mutex;
+	static FILE* File = nullptr;
+	static std::filesystem::path FilePath;
+
+	void Write(std::string& Line, bool bFlush)
+	{
+		Line += "}\n";
+
+		std::lock_guard<std::mutex> Lock(Mutex);
+		if (!File)
+		{
+			return;
+		}
+		fwrite(Line.data(), sizeof(char), Line.size(), File);
+		if (bFlush)
+		{
+			fflush(File);
+		}
+	}
+
+	std::string BeginRecord(const char* Type)
+	{
+		const long long Timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+		char Head[96];
+		snprintf(Head, sizeof(Head), "{\"ts\":%lld,\"type\":\"%s\"", Timestamp, Type);
+		return Head;
+	}
+};
+
+bool OpenEventLog()
+{
+	if (__hidden_Option::EventPath.empty())
+	{
+		return true;
+	}
+
+	std::error_code Error;
+	__hidden_Event::FilePath = std::filesystem::weakly_canonical(__hidden_Option::EventPath, Error);
+	if (Error)
+	{
+		__hidden_Event::FilePath = __hidden_Option::EventPath;
+	}
+
+	_tfopen_s(&__hidden_Event::File, __hidden_Event::FilePath.string<TCHAR>().c_str(), _T("ab"));
+	return __hidden_Event::File != nullptr;
+}
+void CloseEventLog()
+{
+	std::lock_guard<std::mutex> Lock(__hidden_Event::Mutex);
+	if (__hidden_Event::File)
+	{
+		fclose(__hidden_Event::File);
+		__hidden_Event::File = nullptr;
+	}
+}
+// The event log may live inside the destination, where the removal phase must leave it alone.
+bool IsEventLogFile(const std::filesystem::path& Path)
+{
+	return __hidden_Event::File && (_tcsicmp(Path.string<TCHAR>().c_str(), __hidden_Event::FilePath.string<TCHAR>().c_str()) == 0);
+}
+bool IsFileEventEnabled()
+{
+	return __hidden_Event::File && __hidden_Option::bFileEvents;
+}
+
+void EmitPhaseEvent(const char* Name, double Seconds, size_t FileCount, uintmax_t ByteCount, size_t ErrorCount)
+{
+	if (!__hidden_Event::File)
+	{
+		return;
+	}
+
+	std::string Line = __hidden_Event::BeginRecord("phase");
+
+	char Body[192];
+	snprintf(Body, sizeof(Body), ",\"name\":\"%s\",\"duration_ms\":%.3f,\"files\":%zu,\"bytes\":%llu,\"errors\":%zu", Name, Seconds * 1000.0, FileCount, static_cast<unsigned long long>(ByteCount), ErrorCount);
+	Line += Body;
+
+	__hidden_Event::Write(Line, true);
+}
+// "ErrorCode" is the system error of a failed operation and 0 for a successful one.
+void EmitFileEvent(const char* Operation, const std::filesystem::path& Path, uintmax_t ByteCount, double Seconds, unsigned long ErrorCode, const TCHAR* Method = nullptr)
+{
+	if (!IsFileEventEnabled())
+	{
+		return;
+	}
+
+	std::string Line = __hidden_Event::BeginRecord("file");
+
+	char Body[160];
+	snprintf(Body, sizeof(Body), ",\"op\":\"%s\",\"duration_ms\":%.3f,\"bytes\":%llu,\"error\":%lu,\"path\":", Operation, Seconds * 1000.0, static_cast<unsigned long long>(ByteCount), ErrorCode);
+	Line += Body;
+	AppendJsonString(Line, Path.string<TCHAR>());
+	if (Method)
+	{
+		Line += ",\"method\":";
+		AppendJsonString(Line, Method);
+	}
+
+	__hidden_Event::Write(Line, false);
+}
+
+// Marks one phase of a run. The phase record and metrics are written when the scope ends, with the result reported by then, and the phase shows as a trace span.
+class PhaseScope
+{
+public:
+	explicit PhaseScope(const char* _Name) : Name(_Name), StartTime(std::chrono::steady_clock::now()), FileCount(0), ByteCount(0), ErrorCount(0), Trace(_Name, "phase") {}
+	PhaseScope(const PhaseScope& Rhs) = delete;
+
+	~PhaseScope()
+	{
+		const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+		EmitPhaseEvent(Name, Elapsed.count(), FileCount, ByteCount, ErrorCount);
+		RecordPhaseMetric(Name, Elapsed.count(), FileCount, ByteCount, ErrorCount);
+	}
+
+public:
+	PhaseScope& operator=(const PhaseScope& Rhs) = delete;
+
+public:
+	void SetResult(size_t _FileCount, uintmax_t _ByteCount, size_t _ErrorCount)
+	{
+		FileCount = _FileCount;
+		ByteCount = _ByteCount;
+		ErrorCount = _ErrorCount;
+	}
+
+private:
+	const char* Name;
+	std::chrono::steady_clock::time_point StartTime;
+	size_t FileCount;
+	uintmax_t ByteCount;
+	size_t ErrorCount;
+	TraceScope Trace;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+namespace __hidden_Progress
+{
+	// Workers only ever add to the two counters, the reporter thread samples them every "--progress" seconds.
+	static std::atomic<size_t> FileCount = 0;
+	static std::atomic<uintmax_t> ByteCount = 0;
+
+	static const TCHAR* Name = nullptr;
+	static size_t TotalFiles = 0;
+	static uintmax_t TotalBytes = 0;
+	static std::chrono::steady_clock::time_point StartTime;
+
+	static std::thread Reporter;
+	static std::mutex Mutex;
+	static std::condition_variable Wakeup;
+	static bool bStopping = false;
+
+	void Print(double Elapsed, double Current, size_t Files, uintmax_t Bytes)
+	{
+		const double Average = (Elapsed > 0.0) ? (Bytes / Elapsed) : 0.0;
+
+		// Without a byte total, as while hashing, the estimate falls back to the file rate.
+		double Remaining = -1.0;
+		if ((TotalBytes > 0) && (Average > 0.0))
+		{
+			Remaining = (TotalBytes > Bytes) ? ((TotalBytes - Bytes) / Average) : 0.0;
+		}
+		else if ((TotalBytes <= 0) && (Files > 0))
+		{
+			Remaining = (TotalFiles > Files) ? ((TotalFiles - Files) * Elapsed / Files) : 0.0;
+		}
+
+		TCHAR Eta[32];
+		if (Remaining < 0.0)
+		{
+			_stprintf_s(Eta, _T("--:--:--"));
+		}
+		else
+		{
+			const unsigned Seconds = static_cast<unsigned>(Remaining + 0.5);
+			_stprintf_s(Eta, _T("%u:%02u:%02u"), Seconds / 3600, (Seconds / 60) % 60, Seconds % 60);
+		}
+
+		if (TotalBytes > 0)
+		{
+			_tprintf_s(_T("... [%s] %u/%u file(s), %.1f/%.1f MiB, %.1f MiB/s now, %.1f MiB/s average, ETA %s\n"), Name, static_cast<unsigned>(Files), static_cast<unsigned>(TotalFiles), Bytes / 1048576.0, TotalBytes / 1048576.0, Current / 1048576.0, Average / 1048576.0, Eta);
+		}
+		else
+		{
+			_tprintf_s(_T("... [%s] %u/%u file(s), %.1f MiB, %.1f MiB/s now, %.1f MiB/s average, ETA %s\n"), Name, static_cast<unsigned>(Files), static_cast<unsigned>(TotalFiles), Bytes / 1048576.0, Current / 1048576.0, Average / 1048576.0, Eta);
+		}
+	}
+
+	void Run()
+	{
+		size_t LastFiles = 0;
+		uintmax_t LastBytes = 0;
+		auto LastTime = StartTime;
+
+		std::unique_lock<std::mutex> Lock(Mutex);
+		while (!Wakeup.wait_for(Lock, std::chrono::seconds(__hidden_Option::ProgressInterval), [] { return bStopping; }))
+		{
+			const auto CurTime = std::chrono::steady_clock::now();
+			const size_t Files = FileCount.load(std::memory_order_relaxed);
+			const uintmax_t Bytes = ByteCount.load(std::memory_order_relaxed);
+
+			// A quiet interval, as while a single large file is copied, is not worth a line.
+			if ((Files == LastFiles) && (Bytes == LastBytes))
+			{
+				continue;
+			}
+
+			const std::chrono::duration<double> Interval = CurTime - LastTime;
+			const std::chrono::duration<double> Elapsed = CurTime - StartTime;
+			Print(Elapsed.count(), (Interval.count() > 0.0) ? ((Bytes - LastBytes) / Interval.count()) : 0.0, Files, Bytes);
+
+			LastFiles = Files;
+			LastBytes = Bytes;
+			LastTime = CurTime;
+		}
+	}
+};
+
+// Counts finished work towards the running progress. Safe to call from any thread at any time, it never blocks.
+void AddProgress(size_t FileCount, uintmax_t ByteCount)
+{
+	__hidden_Progress::FileCount.fetch_add(FileCount, std::memory_order_relaxed);
+	__hidden_Progress::ByteCount.fetch_add(ByteCount, std::memory_order_relaxed);
+}
+
+// Reports the progress of one phase on the console while the scope lives. "TotalBytes" may be 0 when the sizes are not known up front.
+class ProgressScope
+{
+public:
+	ProgressScope(const TCHAR* Name, size_t TotalFiles, uintmax_t TotalBytes) : bStarted(false)
+	{
+		if ((__hidden_Option::ProgressInterval <= 0) || (__hidden_Option::ConsoleLevel < LogLevel::Summary) || (TotalFiles <= 0))
+		{
+			return;
+		}
+
+		__hidden_Progress::FileCount = 0;
+		__hidden_Progress::ByteCount = 0;
+		__hidden_Progress::Name = Name;
+		__hidden_Progress::TotalFiles = TotalFiles;
+		__hidden_Progress::TotalBytes = TotalBytes;
+		__hidden_Progress::StartTime = std::chrono::steady_clock::now();
+		__hidden_Progress::bStopping = false;
+
+		__hidden_Progress::Reporter = std::thread(__hidden_Progress::Run);
+		__hidden_Log::bProgressActive = true;
+		bStarted = true;
+	}
+	ProgressScope(const ProgressScope& Rhs) = delete;
+
+	~ProgressScope()
+	{
+		if (!bStarted)
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> Lock(__hidden_Progress::Mutex);
+			__hidden_Progress::bStopping = true;
+		}
+		__hidden_Progress::Wakeup.notify_all();
+		__hidden_Progress::Reporter.join();
+		__hidden_Log::bProgressActive = false;
+	}
+
+public:
+	ProgressScope& operator=(const ProgressScope& Rhs) = delete;
+
+private:
+	bool bStarted;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+enum class ProfileOp : unsigned char
+{
+	Scan,
+	ManifestParse,
+	Contained,
+	Hash,
+	Delete,
+	Mkdir,
+	Open,
+	Read,
+	Write,
+	Close,
+};
+
+const TCHAR* ConvertToString(ProfileOp Op)
+{
+	switch (Op)
+	{
+	case ProfileOp::Scan:
+		return _T("scan");
+	case ProfileOp::ManifestParse:
+		return _T("manifest");
+	case ProfileOp::Contained:
+		return _T("contained");
+	case ProfileOp::Hash:
+		return _T("hash");
+	case ProfileOp::Delete:
+		return _T("delete");
+	case ProfileOp::Mkdir:
+		return _T("mkdir");
+	case ProfileOp::Open:
+		return _T("open");
+	case ProfileOp::Read:
+		return _T("read");
+	case ProfileOp::Write:
+		return _T("write");
+	case ProfileOp::Close:
+		return _T("close");
+	default:
+		return _T("none");
+	}
+}
+
+namespace __hidden_Profile
+{
+	// Bucket 0 holds samples below 1 us, bucket i those below 2^i us, the last one everything longer.
+	static constexpr size_t BucketCount = 32;
+
+	struct Histogram
+	{
+		std::atomic<uint64_t> Count;
+		std::atomic<uint64_t> TotalNanoseconds;
+		std::atomic<uint64_t> MaxNanoseconds;
+		std::atomic<uint64_t> Buckets[BucketCount];
+	};
+
+	static Histogram Histograms[static_cast<size_t>(ProfileOp::Close) + 1] = {};
+
+	void Record(ProfileOp Op, uint64_t Nanoseconds)
+	{
+		Histogram& Target = Histograms[static_cast<size_t>(Op)];
+
+		Target.Count.fetch_add(1, std::memory_order_relaxed);
+		Target.TotalNanoseconds.fetch_add(Nanoseconds, std::memory_order_relaxed);
+		Target.Buckets[std::min<size_t>(std::bit_width(Nanoseconds / 1000), BucketCount - 1)].fetch_add(1, std::memory_order_relaxed);
+
+		uint64_t Max = Target.MaxNanoseconds.load(std::memory_order_relaxed);
+		while ((Max < Nanoseconds) && !Target.MaxNanoseconds.compare_exchange_weak(Max, Nanoseconds, std::memory_order_relaxed));
+	}
+
+	// Upper bound in microseconds of the bucket holding the given fraction of the samples.
+	uint64_t GetPercentile(const Histogram& Source, double Fraction)
+	{
+		const uint64_t Count = Source.Count.load(std::memory_order_relaxed);
+		const uint64_t Wanted = std::max<uint64_t>(static_cast<uint64_t>(Count * Fraction + 0.5), 1);
+
+		uint64_t Seen = 0;
+		for (size_t i = 0; i < BucketCount; ++i)
+		{
+			Seen += Source.Buckets[i].load(std::memory_order_relaxed);
+			if (Seen >= Wanted)
+			{
+				return 1ull << i;
+			}
+		}
+		return 1ull << (BucketCount - 1);
+	}
+};
+
+// Times one operation when "--profile" is on. Disabled, it costs a single branch and never reads the clock.
+class ProfileScope
+{
+public:
+	explicit ProfileScope(ProfileOp _Op) : Op(_Op), bEnabled(__hidden_Option::bProfile)
+	{
+		if (bEnabled)
+		{
+			StartTime = std::chrono::steady_clock::now();
+		}
+	}
+	ProfileScope(const ProfileScope& Rhs) = delete;
+
+	~ProfileScope()
+	{
+		if (bEnabled)
+		{
+			const auto Elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - StartTime);
+			__hidden_Profile::Record(Op, static_cast<uint64_t>(Elapsed.count()));
+		}
+	}
+
+public:
+	ProfileScope& operator=(const ProfileScope& Rhs) = delete;
+
+private:
+	ProfileOp Op;
+	bool bEnabled;
+	std::chrono::steady_clock::time_point StartTime;
+};
+
+// Times a single call, for calls sitting inside a condition.
+template <typename Func>
+decltype(auto) Profiled(ProfileOp Op, Func&& Call)
+{
+	ProfileScope Scope(Op);
+	return Call();
+}
+
+void PrintProfile()
+{
+	if (!__hidden_Option::bProfile)
+	{
+		return;
+	}
+
+	PushLog(_T("\n* Profile:\n"));
+	PushLog(LogLevel::Summary, _T("* %-10s %10s %12s %10s %10s %10s %10s %12s\n"), _T("operation"), _T("count"), _T("total ms"), _T("mean us"), _T("p50 us"), _T("p90 us"), _T("p99 us"), _T("max us"));
+	for (size_t i = 0; i < std::size(__hidden_Profile::Histograms); ++i)
+	{
+		const __hidden_Profile::Histogram& Source = __hidden_Profile::Histograms[i];
+		const uint64_t Count = Source.Count.load(std::memory_order_relaxed);
+		if (Count <= 0)
+		{
+			continue;
+		}
+
+		const double Total = Source.TotalNanoseconds.load(std::memory_order_relaxed) / 1000.0;
+		PushLog(LogLevel::Summary, _T("* %-10s %10llu %12.1f %10.1f %10llu %10llu %10llu %12.1f\n"), ConvertToString(static_cast<ProfileOp>(i)), static_cast<unsigned long long>(Count), Total / 1000.0, Total / Count,
+			static_cast<unsigned long long>(__hidden_Profile::GetPercentile(Source, 0.5)), static_cast<unsigned long long>(__hidden_Profile::GetPercentile(Source, 0.9)), static_cast<unsigned long long>(__hidden_Profile::GetPercentile(Source, 0.99)),
+			Source.MaxNanoseconds.load(std::memory_order_relaxed) / 1000.0);
+	}
+	PushLog(LogLevel::Summary, _T("* Percentiles are bucket upper bounds\n"));
+}
+bool WriteProfile()
+{
+	if (__hidden_Option::ProfilePath.empty())
+	{
+		return true;
+	}
+
+	std::string Text = "{\"bucket_bounds_us\":[";
+	for (size_t i = 0; i < __hidden_Profile::BucketCount; ++i)
+	{
+		Text += (i > 0) ? "," : "";
+		Text += std::to_string(1ull << i);
+	}
+	Text += "],\"operations\":{";
+
+	bool bFirst = true;
+	for (size_t i = 0; i < std::size(__hidden_Profile::Histograms); ++i)
+	{
+		const __hidden_Profile::Histogram& Source = __hidden_Profile::Histograms[i];
+		const uint64_t Count = Source.Count.load(std::memory_order_relaxed);
+		if (Count <= 0)
+		{
+			continue;
+		}
+
+		if (!bFirst)
+		{
+			Text += ",";
+		}
+		bFirst = false;
+
+		AppendJsonString(Text, ConvertToString(static_cast<ProfileOp>(i)));
+
+		char Body[256];
+		snprintf(Body, sizeof(Body), ":{\"count\":%llu,\"total_ms\":%.3f,\"max_us\":%.1f,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"buckets\":[", static_cast<unsigned long long>(Count), Source.TotalNanoseconds.load(std::memory_order_relaxed) / 1000000.0,
+			Source.MaxNanoseconds.load(std::memory_order_relaxed) / 1000.0, static_cast<unsigned long long>(__hidden_Profile::GetPercentile(Source, 0.5)), static_cast<unsigned long long>(__hidden_Profile::GetPercentile(Source, 0.9)), static_cast<unsigned long long>(__hidden_Profile::GetPercentile(Source, 0.99)));
+		Text += Body;
+		for (size_t j = 0; j < __hidden_Profile::BucketCount; ++j)
+		{
+			Text += (j > 0) ? "," : "";
+			Text += std::to_string(Source.Buckets[j].load(std::memory_order_relaxed));
+		}
+		Text += "]}";
+	}
+	Text += "}}\n";
+
+	FILE* File = nullptr;
+	_tfopen_s(&File, __hidden_Option::ProfilePath.string<TCHAR>().c_str(), _T("wb"));
+	if (!File)
+	{
+		return false;
+	}
+	const bool bWritten = fwrite(Text.data(), sizeof(char), Text.size(), File) == Text.size();
+	return (fclose(File) == 0) && bWritten;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+namespace __hidden_Buffer
+{
+	// Hands out fixed-size, page aligned buffers. At most "Budget / Size" buffers ever exist, so a lease blocks while all of them are in use.
+	class BufferPool
+	{
+	public:
+		BufferPool() : BufferSize(0), MaxCount(0), AllocatedCount(0), bLargePages(false) {}
+		BufferPool(const BufferPool& Rhs) = delete;
+
+		~BufferPool()
+		{
+			Release();
+		}
+
+	public:
+		BufferPool& operator=(const BufferPool& Rhs) = delete;
+
+	public:
+		void Setup(size_t Budget, size_t Size, bool bUseLargePages)
+		{
+			Release();
+
+			bLargePages = bUseLargePages && EnableLockMemoryPrivilege();
+			if (bUseLargePages && !bLargePages)
+			{
+				PushLog(_T("!!Warning: Large pages are not available, falling back to regular pages\n"));
+			}
+
+			const size_t Granularity = bLargePages ? GetLargePageMinimum() : 4096;
+			BufferSize = (Size + Granularity - 1) / Granularity * Granularity;
+			MaxCount = std::max<size_t>(Budget / BufferSize, 1);
+		}
+		void Release()
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+
+			for (unsigned char* Buffer : FreeBuffers)
+			{
+				VirtualFree(Buffer, 0, MEM_RELEASE);
+			}
+			AllocatedCount -= FreeBuffers.size();
+			FreeBuffers.clear();
+		}
+
+	public:
+		unsigned char* Lease()
+		{
+			std::unique_lock<std::mutex> Lock(Mutex);
+
+			for (;;)
+			{
+				if (!FreeBuffers.empty())
+				{
+					unsigned char* Buffer = FreeBuffers.back();
+					FreeBuffers.pop_back();
+					return Buffer;
+				}
+				if (AllocatedCount < MaxCount)
+				{
+					const DWORD AllocationType = MEM_COMMIT | MEM_RESERVE | (bLargePages ? MEM_LARGE_PAGES : 0);
+					unsigned char* Buffer = reinterpret_cast<unsigned char*>(VirtualAlloc(nullptr, BufferSize, AllocationType, PAGE_READWRITE));
+					if (Buffer)
+					{
+						++AllocatedCount;
+						return Buffer;
+					}
+					if (AllocatedCount == 0)
+					{
+						return nullptr;
+					}
+				}
+
+				Condition.wait(Lock);
+			}
+		}
+		void Return(unsigned char* Buffer)
+		{
+			{
+				std::lock_guard<std::mutex> Lock(Mutex);
+				FreeBuffers.push_back(Buffer);
+			}
+			Condition.notify_one();
+		}
+
+	public:
+		size_t GetBufferSize() const noexcept
+		{
+			return BufferSize;
+		}
+		size_t GetMaxCount() const noexcept
+		{
+			return MaxCount;
+		}
+		bool IsLargePages() const noexcept
+		{
+			return bLargePages;
+		}
+
+	private:
+		static bool EnableLockMemoryPrivilege()
+		{
+			if (GetLargePageMinimum() == 0)
+			{
+				return false;
+			}
+
+			HANDLE Token = nullptr;
+			if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &Token))
+			{
+				return false;
+			}
+
+			TOKEN_PRIVILEGES Privileges = {};
+			Privileges.PrivilegeCount = 1;
+			Privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+			bool bSucceeded = false;
+			if (LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &Privileges.Privileges[0].Luid))
+			{
+				bSucceeded = AdjustTokenPrivileges(Token, FALSE, &Privileges, 0, nullptr, nullptr) && (GetLastError() != ERROR_NOT_ALL_ASSIGNED);
+			}
+
+			CloseHandle(Token);
+			return bSucceeded;
+		}
+
+	private:
+		std::mutex Mutex;
+		std::condition_variable Condition;
+		std::vector<unsigned char*> FreeBuffers;
+
+		size_t BufferSize;
+		size_t MaxCount;
+		size_t AllocatedCount;
+		bool bLargePages;
+	};
+
+	static BufferPool Pool;
+
+	class BufferLease
+	{
+	public:
+		BufferLease() : Buffer(Pool.Lease()) {}
+		BufferLease(const BufferLease& Rhs) = delete;
+
+		~BufferLease()
+		{
+			if (Buffer)
+			{
+				Pool.Return(Buffer);
+			}
+		}
+
+	public:
+		BufferLease& operator=(const BufferLease& Rhs) = delete;
+
+	public:
+		operator bool() const noexcept
+		{
+			return (Buffer != nullptr);
+		}
+		unsigned char* Get() const noexcept
+		{
+			return Buffer;
+		}
+		size_t Size() const noexcept
+		{
+			return Pool.GetBufferSize();
+		}
+
+	private:
+		unsigned char* Buffer;
+	};
+};
+
+typedef __hidden_Buffer::BufferLease BufferLease;
+
+void SetupBufferPool()
+{
+	__hidden_Buffer::Pool.Setup(__hidden_Option::BufferBudget, __hidden_Option::BufferSize, __hidden_Option::bLargePages);
+
+	PushLog(_T("* Buffer pool: %u x %u KiB%s\n"), static_cast<unsigned>(__hidden_Buffer::Pool.GetMaxCount()), static_cast<unsigned>(__hidden_Buffer::Pool.GetBufferSize() >> 10), __hidden_Buffer::Pool.IsLargePages() ? _T(" (large pages)") : _T(""));
+}
+void ReleaseBufferPool()
+{
+	__hidden_Buffer::Pool.Release();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+namespace __hidden_Throttle
+{
+	// Reservation based token bucket. A caller takes what it needs right away and sleeps off the debt, so large requests are never starved
+	// by small ones, and the bucket never holds more than one second worth of tokens.
+	class TokenBucket
+	{
+	public:
+		TokenBucket() : Rate(0.0), Tokens(0.0), LastTime(std::chrono::steady_clock::now()) {}
+		TokenBucket(const TokenBucket& Rhs) = delete;
+
+	public:
+		TokenBucket& operator=(const TokenBucket& Rhs) = delete;
+
+	public:
+		void SetRate(double NewRate)
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+
+			Refill();
+			Rate = NewRate;
+			Tokens = std::min(Tokens, NewRate);
+		}
+		double GetRate() const noexcept
+		{
+			return Rate;
+		}
+
+	public:
+		void Acquire(double Amount)
+		{
+			if (Rate <= 0.0)
+			{
+				return;
+			}
+
+			double WaitSeconds = 0.0;
+			{
+				std::lock_guard<std::mutex> Lock(Mutex);
+
+				if (Rate <= 0.0)
+				{
+					return;
+				}
+
+				Refill();
+				Tokens -= Amount;
+				if (Tokens < 0.0)
+				{
+					WaitSeconds = -Tokens / Rate;
+				}
+			}
+
+			if (WaitSeconds > 0.0)
+			{
+				std::this_thread::sleep_for(std::chrono::duration<double>(WaitSeconds));
+			}
+		}
+
+	private:
+		void Refill()
+		{
+			const auto CurTime = std::chrono::steady_clock::now();
+			const std::chrono::duration<double> Elapsed = CurTime - LastTime;
+			LastTime = CurTime;
+
+			Tokens = std::min(Tokens + (Elapsed.count() * Rate), Rate.load());
+		}
+
+	private:
+		std::mutex Mutex;
+		std::atomic<double> Rate;
+		double Tokens;
+		std::chrono::steady_clock::time_point LastTime;
+	};
+
+	static TokenBucket ReadBucket;
+	static TokenBucket WriteBucket;
+	static TokenBucket FileBucket;
+
+	static std::mutex ControlMutex;
+	static std::chrono::steady_clock::time_point LastControlCheck;
+	static std::filesystem::file_time_type LastControlWrite;
+
+	// Re-reads the control file when it changed. Lines look like "read=50M", "write=50M" or "files=200", a value of 0 removes the limit.
+	void ReloadControlFile()
+	{
+		std::error_code Error;
+
+		if (__hidden_Option::ThrottleFile.empty())
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> Lock(ControlMutex, std::try_to_lock);
+		if (!Lock)
+		{
+			return;
+		}
+
+		const auto CurTime = std::chrono::steady_clock::now();
+		if ((CurTime - LastControlCheck) < std::chrono::seconds(1))
+		{
+			return;
+		}
+		LastControlCheck = CurTime;
+
+		const std::filesystem::file_time_type WriteTime = std::filesystem::last_write_time(__hidden_Option::ThrottleFile, Error);
+		if (Error || (WriteTime == LastControlWrite))
+		{
+			return;
+		}
+		LastControlWrite = WriteTime;
+
+		FILE* File = nullptr;
+		_tfopen_s(&File, __hidden_Option::ThrottleFile.string<TCHAR>().c_str(), _T("rt"));
+		if (!File)
+		{
+			return;
+		}
+
+		TCHAR Line[256];
+		while (_fgetts(Line, static_cast<int>(std::size(Line)), File))
+		{
+			std::basic_string<TCHAR> Entry(Line);
+			while (!Entry.empty() && ((Entry.back() == _T('\n')) || (Entry.back() == _T('\r')) || (Entry.back() == _T(' '))))
+			{
+				Entry.pop_back();
+			}
+
+			const size_t Separator = Entry.find(_T('='));
+			if (Separator == std::basic_string<TCHAR>::npos)
+			{
+				continue;
+			}
+
+			size_t Value = 0;
+			if (!__hidden_Option::ParseSize(Entry.c_str() + Separator + 1, Value))
+			{
+				continue;
+			}
+
+			const std::basic_string<TCHAR> Name = Entry.substr(0, Separator);
+			if (Name == _T("read"))
+			{
+				ReadBucket.SetRate(static_cast<double>(Value));
+			}
+			else if (Name == _T("write"))
+			{
+				WriteBucket.SetRate(static_cast<double>(Value));
+			}
+			else if (Name == _T("files"))
+			{
+				FileBucket.SetRate(static_cast<double>(Value));
+			}
+		}
+		fclose(File);
+
+		PushLog(_T("* Throttle changed: read %.1f MiB/s, write %.1f MiB/s, %.0f files/s (0 = unlimited)\n"), ReadBucket.GetRate() / 1048576.0, WriteBucket.GetRate() / 1048576.0, FileBucket.GetRate());
+	}
+};
+
+void SetupThrottle()
+{
+	__hidden_Throttle::ReadBucket.SetRate(static_cast<double>(__hidden_Option::ReadLimit));
+	__hidden_Throttle::WriteBucket.SetRate(static_cast<double>(__hidden_Option::WriteLimit));
+	__hidden_Throttle::FileBucket.SetRate(static_cast<double>(__hidden_Option::FileLimit));
+	__hidden_Throttle::ReloadControlFile();
+}
+bool IsThrottled()
+{
+	return (__hidden_Throttle::ReadBucket.GetRate() > 0.0) || (__hidden_Throttle::WriteBucket.GetRate() > 0.0) || !__hidden_Option::ThrottleFile.empty();
+}
+void ThrottleRead(uintmax_t Bytes)
+{
+	__hidden_Throttle::ReadBucket.Acquire(static_cast<double>(Bytes));
+}
+void ThrottleWrite(uintmax_t Bytes)
+{
+	__hidden_Throttle::WriteBucket.Acquire(static_cast<double>(Bytes));
+}
+// Called once per file by every copy and hash path, which is also where changes of the control file are picked up.
+void ThrottleFile()
+{
+	__hidden_Throttle::ReloadControlFile();
+	__hidden_Throttle::FileBucket.Acquire(1.0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct RawHash
+{
+	unsigned char Raw[512];
+};
+
+// Only the leading SHA-512 digest of a RawHash carries data, the remainder is whatever the manifest happens to store.
+bool IsSameDigest(const RawHash& Lhs, const RawHash& Rhs)
+{
+	return memcmp(Lhs.Raw, Rhs.Raw, SHA512_DIGEST_SIZE) == 0;
+}
+
+struct DigestHasher
+{
+	size_t operator()(const RawHash& Hash) const noexcept
+	{
+		size_t Value;
+		memcpy(&Value, Hash.Raw, sizeof(Value));
+		return Value;
+	}
+};
+struct DigestEqualTo
+{
+	bool operator()(const RawHash& Lhs, const RawHash& Rhs) const noexcept
+	{
+		return IsSameDigest(Lhs, Rhs);
+	}
+};
+
+template <typename Value>
+using DigestMap = std::unordered_map<RawHash, Value, DigestHasher, DigestEqualTo>;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+namespace __hidden_File
+{
+	struct Hasher
+	{
+		size_t operator()(const std::filesystem::path& Val) const noexcept
+		{
+			return std::filesystem::hash_value(Val);
+		}
+	};
+	struct EqualTo{
+		bool operator()(const std::filesystem::path& Lhs, const std::filesystem::path& Rhs) const noexcept
+		{
+			std::error_code Error;
+			
+			const size_t Val = std::filesystem::equivalent(Lhs, Rhs, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Error occurred while comparing paths \"%s\" and \"%s\"\n"), Lhs.string<TCHAR>().c_str(), Rhs.string<TCHAR>().c_str());
+				return false;
+			}
+			return Val;
+		}
+	};
+
+	class FileIO
+	{
+	public:
+		FileIO() : File(nullptr) {}
+		FileIO(const std::filesystem::path& _FilePath, const TCHAR* Mode) : File(nullptr), FilePath(_FilePath)
+		{
+			ProfileScope Profile(ProfileOp::Open);
+			_tfopen_s(&File, FilePath.string<TCHAR>().c_str(), Mode);
+		}
+		FileIO(std::filesystem::path&& _FilePath, const TCHAR* Mode) : File(nullptr), FilePath(std::move(_FilePath))
+		{
+			ProfileScope Profile(ProfileOp::Open);
+			_tfopen_s(&File, FilePath.string<TCHAR>().c_str(), Mode);
+		}
+		FileIO(const FileIO& Rhs) = delete; 
+		FileIO(FileIO&& Rhs) noexcept : File(Rhs.File), FilePath(std::move(Rhs.FilePath)) { Rhs.File = nullptr; }
+
+		~FileIO()
+		{
+			if (File)
+			{
+				Close();
+			}
+		}
+
+	public:
+		FileIO& operator=(const FileIO& Rhs) = delete;
+		FileIO& operator=(FileIO&& Rhs) noexcept
+		{
+			if (File)
+			{
+				Close();
+			}
+			
+			File = Rhs.File;
+			FilePath = std::move(Rhs.FilePath);
+
+			Rhs.File = nullptr;
+
+			return *this;
+		}
+
+	public:
+		operator bool() const noexcept
+		{
+			return (File != nullptr);
+		}
+		FILE* Get() const noexcept
+		{
+			return File;
+		}
+
+	public:
+		bool CloseWithReturn()
+		{
+			ProfileScope Profile(ProfileOp::Close);
+			if (fclose(File))
+			{
+				return false;
+			}
+			File = nullptr;
+			return true;
+		}
+		void Close()
+		{
+			if (!CloseWithReturn())
+			{
+				PushLog(_T("!!Error: Failed to close file \"%s\"\n"), FilePath.string<TCHAR>().c_str());
+			}
+		}
+		
+	private:
+		FILE* File;
+		std::filesystem::path FilePath;
+	};
+	class HandleIO
+	{
+	public:
+		HandleIO() : Handle(INVALID_HANDLE_VALUE) {}
+		HandleIO(const std::filesystem::path& _FilePath, DWORD Access, DWORD ShareMode, DWORD Disposition, DWORD FlagsAndAttributes = FILE_ATTRIBUTE_NORMAL) : Handle(INVALID_HANDLE_VALUE), FilePath(_FilePath)
+		{
+			ProfileScope Profile(ProfileOp::Open);
+			Handle = CreateFile(FilePath.string<TCHAR>().c_str(), Access, ShareMode, nullptr, Disposition, FlagsAndAttributes, nullptr);
+		}
+		HandleIO(const HandleIO& Rhs) = delete;
+		HandleIO(HandleIO&& Rhs) noexcept : Handle(Rhs.Handle), FilePath(std::move(Rhs.FilePath)) { Rhs.Handle = INVALID_HANDLE_VALUE; }
+
+		~HandleIO()
+		{
+			if (Handle != INVALID_HANDLE_VALUE)
+			{
+				Close();
+			}
+		}
+
+	public:
+		HandleIO& operator=(const HandleIO& Rhs) = delete;
+		HandleIO& operator=(HandleIO&& Rhs) noexcept
+		{
+			if (Handle != INVALID_HANDLE_VALUE)
+			{
+				Close();
+			}
+
+			Handle = Rhs.Handle;
+			FilePath = std::move(Rhs.FilePath);
+
+			Rhs.Handle = INVALID_HANDLE_VALUE;
+
+			return *this;
+		}
+
+	public:
+		operator bool() const noexcept
+		{
+			return (Handle != INVALID_HANDLE_VALUE);
+		}
+		HANDLE Get() const noexcept
+		{
+			return Handle;
+		}
+
+	public:
+		bool CloseWithReturn()
+		{
+			ProfileScope Profile(ProfileOp::Close);
+			if (!CloseHandle(Handle))
+			{
+				return false;
+			}
+			Handle = INVALID_HANDLE_VALUE;
+			return true;
+		}
+		void Close()
+		{
+			if (!CloseWithReturn())
+			{
+				PushLog(_T("!!Error: Failed to close file \"%s\"\n"), FilePath.string<TCHAR>().c_str());
+			}
+		}
+
+	private:
+		HANDLE Handle;
+		std::filesystem::path FilePath;
+	};
+
+	static constexpr LONGLONG CloneChunkSize = 1ll * 1024 * 1024 * 1024;
+
+	// Block clone support of the volume holding each destination directory. A volume does not change its file system during a run.
+	static std::shared_mutex CloneMutex;
+	static std::unordered_map<std::basic_string<TCHAR>, bool> CloneDirectories;
+
+	static std::atomic<bool> bVolumeFlushUnavailable = false;
+
+	static const unsigned char ZeroBlock[64 * 1024] = {};
+
+	static std::shared_mutex DirectoryMutex;
+	static std::unordered_set<std::basic_string<TCHAR>> KnownDirectories;
+};
+
+typedef __hidden_File::FileIO FilePtr;
+typedef __hidden_File::HandleIO HandlePtr;
+
+using PathSet = std::unordered_set<std::filesystem::path, __hidden_File::Hasher, __hidden_File::EqualTo>;
+template <typename Value>
+using PathMap = std::unordered_map<std::filesystem::path, Value, __hidden_File::Hasher, __hidden_File::EqualTo>;
+
+std::basic_string<TCHAR> ReadFileStringLine(FilePtr& File)
+{
+	std::basic_string<TCHAR> TmpString;
+	while (!feof(File.Get()))
+	{
+		TCHAR Char = _fgettc(File.Get());
+		if (Char == _T('\r'))
+		{
+			continue;
+		}
+		else if (Char == _T('\n'))
+		{
+			break;
+		}
+		else if (Char == static_cast<TCHAR>(-1))
+		{
+			break;
+		}
+		TmpString.push_back(Char);
+	}
+
+	if (TmpString.empty())
+	{
+		return std::filesystem::path();
+	}
+
+	return std::move(TmpString);
+}
+std::filesystem::path ReadFileLine(FilePtr& File)
+{
+	std::error_code Error;
+	
+	std::basic_string<TCHAR> TmpString(ReadFileStringLine(File));
+	if (TmpString.empty())
+	{
+		return std::filesystem::path();
+	}
+
+	std::filesystem::path Path = TmpString;
+	Path = std::filesystem::canonical(Path, Error);
+	if (Error)
+	{
+		PushLog(_T("!!Error: Error occurred while canonicalizing \"%s\"\n"), TmpString.c_str());
+		return std::filesystem::path();
+	}
+	
+	return std::move(Path);
+}
+std::filesystem::path ReadFileLine(FilePtr& File, bool& bExclude)
+{
+	std::error_code Error;
+	
+	std::basic_string<TCHAR> TmpString(ReadFileStringLine(File));
+	if (TmpString.empty())
+	{
+		return std::filesystem::path();
+	}
+
+	if (TmpString[0] == _T('~'))
+	{
+		bExclude = true;
+		TmpString = TmpString.substr(1);
+	}
+	else
+	{
+		bExclude = false;
+	}
+
+	std::filesystem::path Path = TmpString;
+	Path = std::filesystem::canonical(Path, Error);
+	if (Error)
+	{
+		PushLog(_T("!!Error: Error occurred while canonicalizing \"%s\"\n"), TmpString.c_str());
+		return std::filesystem::path();
+	}
+	
+	return std::move(Path);
+}
+
+bool CheckIfFileContained(const std::deque<std::filesystem::path>& Table, const std::filesystem::path& Path)
+{
+	ProfileScope Profile(ProfileOp::Contained);
+
+	std::error_code Error;
+	
+	for (const auto& Compare : Table)
+	{
+		const bool bIsEqual = std::filesystem::equivalent(Compare, Path, Error);
+		if (Error)
+		{
+			PushLog(_T("!!Error: Error occurred while comparing paths \"%s\" and \"%s\"\n"), Compare.string<TCHAR>().c_str(), Path.string<TCHAR>().c_str());
+			return false;
+		}
+		if (bIsEqual)
+		{
+			return true;
+		}
+
+		auto Lhs = Compare.string<TCHAR>();
+		auto Rhs = Path.string<TCHAR>();
+
+		std::transform(Lhs.begin(), Lhs.end(), Lhs.begin(), ::tolower);
+		std::transform(Rhs.begin(), Rhs.end(), Rhs.begin(), ::tolower);
+
+		if (Rhs.starts_with(Lhs))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+enum class CopyMethod : unsigned char
+{
+	None,
+	BlockClone,
+	Sparse,
+	Direct,
+	Kernel,
+	Async,
+	Pack,
+	Checkpoint,
+	HardLink,
+	Buffered,
+};
+
+const TCHAR* ConvertToString(CopyMethod Method)
+{
+	switch (Method)
+	{
+	case CopyMethod::BlockClone:
+		return _T("block clone");
+	case CopyMethod::Sparse:
+		return _T("sparse copy");
+	case CopyMethod::Direct:
+		return _T("direct I/O");
+	case CopyMethod::Kernel:
+		return _T("kernel copy");
+	case CopyMethod::Async:
+		return _T("async copy");
+	case CopyMethod::Pack:
+		return _T("pack stream");
+	case CopyMethod::Checkpoint:
+		return _T("checkpointed copy");
+	case CopyMethod::HardLink:
+		return _T("hard link");
+	case CopyMethod::Buffered:
+		return _T("buffered copy");
+	default:
+		return _T("none");
+	}
+}
+
+struct CopyResult
+{
+	CopyMethod Method;
+	uintmax_t HoleBytes;
+	bool bDigestMismatch;
+};
+
+// Feeds the zeros a hole reads back as, so sparse copies hash like dense ones.
+void HashZeros(sha512_ctx* CTX, uintmax_t Count)
+{
+	while (Count > 0)
+	{
+		const size_t Size = static_cast<size_t>(std::min<uintmax_t>(Count, sizeof(__hidden_File::ZeroBlock)));
+		sha512_update(CTX, __hidden_File::ZeroBlock, static_cast<unsigned int>(Size));
+		Count -= Size;
+	}
+}
+
+bool IsBlockCloneDirectory(const std::filesystem::path& Directory)
+{
+	const std::basic_string<TCHAR> Key = Directory.string<TCHAR>();
+	{
+		std::shared_lock<std::shared_mutex> Lock(__hidden_File::CloneMutex);
+		auto Found = __hidden_File::CloneDirectories.find(Key);
+		if (Found != __hidden_File::CloneDirectories.end())
+		{
+			return Found->second;
+		}
+	}
+
+	TCHAR MountPoint[MAX_PATH];
+	DWORD FileSystemFlags = 0;
+	const bool bSupported = GetVolumePathName(Key.c_str(), MountPoint, MAX_PATH) && GetVolumeInformation(MountPoint, nullptr, 0, nullptr, nullptr, &FileSystemFlags, nullptr, 0)
+		&& (FileSystemFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING);
+
+	std::unique_lock<std::shared_mutex> Lock(__hidden_File::CloneMutex);
+	__hidden_File::CloneDirectories.emplace(Key, bSupported);
+	return bSupported;
+}
+
+// Shares the source's physical clusters with the destination. Only ReFS (and Dev Drive) volumes support this, and both files have to live on the same volume.
+// Other volumes are told apart without opening the source.
+bool BlockCloneFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath)
+{
+	if (!IsBlockCloneDirectory(ToPath.parent_path()))
+	{
+		return false;
+	}
+
+	HandlePtr FromFile(FromPath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING);
+	if (!FromFile)
+	{
+		return false;
+	}
+
+	DWORD Returned = 0;
+	FSCTL_GET_INTEGRITY_INFORMATION_BUFFER Integrity = {};
+	if (!DeviceIoControl(FromFile.Get(), FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &Integrity, sizeof(Integrity), &Returned, nullptr))
+	{
+		return false;
+	}
+	if (Integrity.ClusterSizeInBytes == 0)
+	{
+		return false;
+	}
+
+	FILE_BASIC_INFO BasicInfo = {};
+	if (!GetFileInformationByHandleEx(FromFile.Get(), FileBasicInfo, &BasicInfo, sizeof(BasicInfo)))
+	{
+		return false;
+	}
+
+	LARGE_INTEGER FileSize;
+	if (!GetFileSizeEx(FromFile.Get(), &FileSize))
+	{
+		return false;
+	}
+
+	HandlePtr ToFile(ToPath, GENERIC_READ | GENERIC_WRITE, 0, CREATE_ALWAYS);
+	if (!ToFile)
+	{
+		return false;
+	}
+
+	if (BasicInfo.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE)
+	{
+		if (!DeviceIoControl(ToFile.Get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &Returned, nullptr))
+		{
+			return false;
+		}
+	}
+
+	// Cloned regions have to end on a cluster boundary, so the destination is grown to the rounded size first and cut back afterwards.
+	const LONGLONG ClusterSize = Integrity.ClusterSizeInBytes;
+	const LONGLONG RoundedSize = (FileSize.QuadPart + ClusterSize - 1) / ClusterSize * ClusterSize;
+
+	FILE_END_OF_FILE_INFO EndOfFile;
+	EndOfFile.EndOfFile.QuadPart = RoundedSize;
+	if (!SetFileInformationByHandle(ToFile.Get(), FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile)))
+	{
+		return false;
+	}
+
+	for (LONGLONG Offset = 0; Offset < RoundedSize; Offset += __hidden_File::CloneChunkSize)
+	{
+		DUPLICATE_EXTENTS_DATA Extents;
+		Extents.FileHandle = FromFile.Get();
+		Extents.SourceFileOffset.QuadPart = Offset;
+		Extents.TargetFileOffset.QuadPart = Offset;
+		Extents.ByteCount.QuadPart = std::min(__hidden_File::CloneChunkSize, RoundedSize - Offset);
+
+		if (!DeviceIoControl(ToFile.Get(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &Extents, sizeof(Extents), nullptr, 0, &Returned, nullptr))
+		{
+			return false;
+		}
+	}
+
+	EndOfFile.EndOfFile.QuadPart = FileSize.QuadPart;
+	if (!SetFileInformationByHandle(ToFile.Get(), FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile)))
+	{
+		return false;
+	}
+
+	return ToFile.CloseWithReturn();
+}
+// Reserves the clusters of a file before writing it, so large files are laid out in few extents instead of growing write by write.
+// Returns false only when the volume is out of space. Other failures, like file systems without allocation support, are ignored.
+bool PreallocateFile(HANDLE File, uintmax_t Size)
+{
+	FILE_ALLOCATION_INFO Allocation;
+	Allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(Size);
+	if (SetFileInformationByHandle(File, FileAllocationInfo, &Allocation, sizeof(Allocation)))
+	{
+		return true;
+	}
+	return GetLastError() != ERROR_DISK_FULL;
+}
+
+// Copies only the allocated ranges of a sparse source into a sparse destination, so the holes stay holes instead of being written out as zeros.
+// Fails for sources that are not sparse and for destinations whose file system does not support sparse files.
+bool SparseFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath, uintmax_t& HoleBytes, sha512_ctx* Digest)
+{
+	HoleBytes = 0;
+	if (Digest)
+	{
+		sha512_init(Digest);
+	}
+
+	HandlePtr FromFile(FromPath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	if (!FromFile)
+	{
+		return false;
+	}
+
+	FILE_BASIC_INFO BasicInfo = {};
+	if (!GetFileInformationByHandleEx(FromFile.Get(), FileBasicInfo, &BasicInfo, sizeof(BasicInfo)))
+	{
+		return false;
+	}
+	if (!(BasicInfo.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE))
+	{
+		return false;
+	}
+
+	LARGE_INTEGER FileSize;
+	if (!GetFileSizeEx(FromFile.Get(), &FileSize))
+	{
+		return false;
+	}
+
+	HandlePtr ToFile(ToPath, GENERIC_WRITE, 0, CREATE_ALWAYS);
+	if (!ToFile)
+	{
+		return false;
+	}
+
+	DWORD Returned = 0;
+	if (!DeviceIoControl(ToFile.Get(), FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &Returned, nullptr))
+	{
+		return false;
+	}
+
+	// Growing a sparse file leaves the new range unallocated, so everything not written below remains a hole.
+	FILE_END_OF_FILE_INFO EndOfFile;
+	EndOfFile.EndOfFile.QuadPart = FileSize.QuadPart;
+	if (!SetFileInformationByHandle(ToFile.Get(), FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile)))
+	{
+		return false;
+	}
+
+	BufferLease Buffer;
+	if (!Buffer)
+	{
+		return false;
+	}
+
+	LONGLONG DataBytes = 0;
+	LONGLONG HashedOffset = 0;
+
+	FILE_ALLOCATED_RANGE_BUFFER Query;
+	Query.FileOffset.QuadPart = 0;
+	Query.Length.QuadPart = FileSize.QuadPart;
+
+	FILE_ALLOCATED_RANGE_BUFFER Ranges[64];
+	for (;;)
+	{
+		const BOOL bQueried = DeviceIoControl(FromFile.Get(), FSCTL_QUERY_ALLOCATED_RANGES, &Query, sizeof(Query), Ranges, sizeof(Ranges), &Returned, nullptr);
+		if (!bQueried && (GetLastError() != ERROR_MORE_DATA))
+		{
+			return false;
+		}
+
+		const size_t RangeCount = Returned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+		for (size_t i = 0; i < RangeCount; ++i)
+		{
+			if (Digest)
+			{
+				HashZeros(Digest, static_cast<uintmax_t>(Ranges[i].FileOffset.QuadPart - HashedOffset));
+				HashedOffset = Ranges[i].FileOffset.QuadPart + Ranges[i].Length.QuadPart;
+			}
+
+			const LONGLONG End = Ranges[i].FileOffset.QuadPart + Ranges[i].Length.QuadPart;
+			for (LONGLONG Offset = Ranges[i].FileOffset.QuadPart; Offset < End;)
+			{
+				const DWORD Size = static_cast<DWORD>(std::min<LONGLONG>(static_cast<LONGLONG>(std::min<size_t>(Buffer.Size(), 1u << 30)), End - Offset));
+
+				OVERLAPPED Position = {};
+				Position.Offset = static_cast<DWORD>(Offset);
+				Position.OffsetHigh = static_cast<DWORD>(Offset >> 32);
+
+				DWORD Read = 0;
+				if (!Profiled(ProfileOp::Read, [&] { return ReadFile(FromFile.Get(), Buffer.Get(), Size, &Read, &Position); }) || (Read == 0))
+				{
+					return false;
+				}
+				ThrottleRead(Read);
+				if (Digest)
+				{
+					sha512_update(Digest, Buffer.Get(), static_cast<unsigned int>(Read));
+				}
+
+				ThrottleWrite(Read);
+
+				DWORD Wrote = 0;
+				if (!Profiled(ProfileOp::Write, [&] { return WriteFile(ToFile.Get(), Buffer.Get(), Read, &Wrote, &Position); }) || (Wrote != Read))
+				{
+					return false;
+				}
+
+				Offset += Read;
+				DataBytes += Read;
+			}
+		}
+
+		if (bQueried || (RangeCount == 0))
+		{
+			break;
+		}
+
+		Query.FileOffset.QuadPart = Ranges[RangeCount - 1].FileOffset.QuadPart + Ranges[RangeCount - 1].Length.QuadPart;
+		Query.Length.QuadPart = FileSize.QuadPart - Query.FileOffset.QuadPart;
+	}
+
+	if (Digest)
+	{
+		HashZeros(Digest, static_cast<uintmax_t>(FileSize.QuadPart - HashedOffset));
+	}
+
+	HoleBytes = static_cast<uintmax_t>(FileSize.QuadPart - DataBytes);
+	return ToFile.CloseWithReturn();
+}
+// Reads and writes with FILE_FLAG_NO_BUFFERING, so large files neither evict nor populate the system file cache.
+// Unbuffered transfers have to be sector aligned, which the page aligned pool buffers already are for sectors up to 4K.
+bool DirectFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath, sha512_ctx* Digest, bool& bOutOfSpace)
+{
+	bOutOfSpace = false;
+
+	if (Digest)
+	{
+		sha512_init(Digest);
+	}
+
+	HandlePtr FromFile(FromPath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN);
+	if (!FromFile)
+	{
+		return false;
+	}
+
+	HandlePtr ToFile(ToPath, GENERIC_WRITE, 0, CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING);
+	if (!ToFile)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER FileSize;
+	if (!GetFileSizeEx(FromFile.Get(), &FileSize))
+	{
+		return false;
+	}
+	if (!PreallocateFile(ToFile.Get(), static_cast<uintmax_t>(FileSize.QuadPart)))
+	{
+		bOutOfSpace = true;
+		return false;
+	}
+
+	FILE_STORAGE_INFO FromStorage = {};
+	FILE_STORAGE_INFO ToStorage = {};
+	if (!GetFileInformationByHandleEx(FromFile.Get(), FileStorageInfo, &FromStorage, sizeof(FromStorage)))
+	{
+		return false;
+	}
+	if (!GetFileInformationByHandleEx(ToFile.Get(), FileStorageInfo, &ToStorage, sizeof(ToStorage)))
+	{
+		return false;
+	}
+
+	BufferLease Buffer;
+	if (!Buffer)
+	{
+		return false;
+	}
+
+	const size_t Alignment = std::max<size_t>(std::max(FromStorage.LogicalBytesPerSector, ToStorage.LogicalBytesPerSector), 1);
+	if ((Alignment > 4096) || (Buffer.Size() % Alignment))
+	{
+		return false;
+	}
+
+	const DWORD ChunkSize = static_cast<DWORD>(std::min<size_t>(Buffer.Size(), 1u << 30));
+	LONGLONG Written = 0;
+	for (;;)
+	{
+		DWORD Read = 0;
+		if (!Profiled(ProfileOp::Read, [&] { return ReadFile(FromFile.Get(), Buffer.Get(), ChunkSize, &Read, nullptr); }))
+		{
+			return false;
+		}
+		if (Read == 0)
+		{
+			break;
+		}
+		ThrottleRead(Read);
+		if (Digest)
+		{
+			sha512_update(Digest, Buffer.Get(), static_cast<unsigned int>(Read));
+		}
+
+		// The tail is padded up to a whole sector, the end of file is cut back below.
+		const DWORD AlignedSize = static_cast<DWORD>((Read + Alignment - 1) / Alignment * Alignment);
+		memset(Buffer.Get() + Read, 0, AlignedSize - Read);
+
+		ThrottleWrite(AlignedSize);
+
+		DWORD Wrote = 0;
+		if (!Profiled(ProfileOp::Write, [&] { return WriteFile(ToFile.Get(), Buffer.Get(), AlignedSize, &Wrote, nullptr); }) || (Wrote != AlignedSize))
+		{
+			return false;
+		}
+		Written += Read;
+
+		if (Read < ChunkSize)
+		{
+			break;
+		}
+	}
+
+	FILE_END_OF_FILE_INFO EndOfFile;
+	EndOfFile.EndOfFile.QuadPart = Written;
+	if (!SetFileInformationByHandle(ToFile.Get(), FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile)))
+	{
+		return false;
+	}
+
+	return ToFile.CloseWithReturn();
+}
+// Charges the bytes the system copied since the last call against the throttle, the sleep in here holds the copy back.
+DWORD CALLBACK KernelFileCopyProgress(LARGE_INTEGER TotalFileSize, LARGE_INTEGER TotalBytesTransferred, LARGE_INTEGER StreamSize, LARGE_INTEGER StreamBytesTransferred, DWORD StreamNumber, DWORD CallbackReason, HANDLE SourceFile, HANDLE DestinationFile, LPVOID Data)
+{
+	LONGLONG& Reported = *reinterpret_cast<LONGLONG*>(Data);
+	if (TotalBytesTransferred.QuadPart > Reported)
+	{
+		const uintmax_t Delta = static_cast<uintmax_t>(TotalBytesTransferred.QuadPart - Reported);
+		Reported = TotalBytesTransferred.QuadPart;
+
+		ThrottleRead(Delta);
+		ThrottleWrite(Delta);
+	}
+	return PROGRESS_CONTINUE;
+}
+// Lets the system copy the data without passing it through this process. Over SMB this becomes a server-side (offloaded) copy.
+bool KernelFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath)
+{
+	LONGLONG Reported = 0;
+	LPPROGRESS_ROUTINE Progress = IsThrottled() ? KernelFileCopyProgress : nullptr;
+	return CopyFileEx(FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str(), Progress, &Reported, nullptr, 0) != FALSE;
+}
+// Copies through positioned I/O and makes the copied part durable every CheckpointSize bytes before handing the offset to "Checkpoint".
+// A non-zero "Offset" continues the staging file of an interrupted run, the digest of that part is rebuilt from the staging file itself.
+template <typename CheckpointFunc>
+bool CheckpointFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath, uintmax_t Offset, sha512_ctx* Digest, CheckpointFunc Checkpoint)
+{
+	if (Digest)
+	{
+		sha512_init(Digest);
+	}
+
+	HandlePtr FromFile(FromPath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	if (!FromFile)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER FileSize;
+	if (!GetFileSizeEx(FromFile.Get(), &FileSize))
+	{
+		return false;
+	}
+
+	HandlePtr ToFile(ToPath, GENERIC_READ | GENERIC_WRITE, 0, (Offset > 0) ? OPEN_EXISTING : CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN);
+	if (!ToFile)
+	{
+		return false;
+	}
+	if (!PreallocateFile(ToFile.Get(), static_cast<uintmax_t>(FileSize.QuadPart)))
+	{
+		return false;
+	}
+
+	BufferLease Buffer;
+	if (!Buffer)
+	{
+		return false;
+	}
+
+	const DWORD ChunkSize = static_cast<DWORD>(std::min<size_t>(Buffer.Size(), 1u << 30));
+
+	for (uintmax_t Position = 0; Digest && (Position < Offset);)
+	{
+		OVERLAPPED At = {};
+		At.Offset = static_cast<DWORD>(Position);
+		At.OffsetHigh = static_cast<DWORD>(Position >> 32);
+
+		const DWORD Size = static_cast<DWORD>(std::min<uintmax_t>(ChunkSize, Offset - Position));
+		DWORD Read = 0;
+		if (!Profiled(ProfileOp::Read, [&] { return ReadFile(ToFile.Get(), Buffer.Get(), Size, &Read, &At); }) || (Read != Size))
+		{
+			return false;
+		}
+		sha512_update(Digest, Buffer.Get(), static_cast<unsigned int>(Read));
+		Position += Read;
+	}
+
+	uintmax_t Uncommitted = 0;
+	for (;;)
+	{
+		OVERLAPPED At = {};
+		At.Offset = static_cast<DWORD>(Offset);
+		At.OffsetHigh = static_cast<DWORD>(Offset >> 32);
+
+		DWORD Read = 0;
+		if (!Profiled(ProfileOp::Read, [&] { return ReadFile(FromFile.Get(), Buffer.Get(), ChunkSize, &Read, &At); }))
+		{
+			if (GetLastError() == ERROR_HANDLE_EOF)
+			{
+				break;
+			}
+			return false;
+		}
+		if (Read == 0)
+		{
+			break;
+		}
+		ThrottleRead(Read);
+		if (Digest)
+		{
+			sha512_update(Digest, Buffer.Get(), static_cast<unsigned int>(Read));
+		}
+
+		ThrottleWrite(Read);
+
+		DWORD Wrote = 0;
+		if (!Profiled(ProfileOp::Write, [&] { return WriteFile(ToFile.Get(), Buffer.Get(), Read, &Wrote, &At); }) || (Wrote != Read))
+		{
+			return false;
+		}
+		Offset += Read;
+		Uncommitted += Read;
+
+		if (Uncommitted >= __hidden_Option::CheckpointSize)
+		{
+			if (!FlushFileBuffers(ToFile.Get()))
+			{
+				return false;
+			}
+			Checkpoint(Offset);
+			Uncommitted = 0;
+		}
+	}
+
+	// The staging file of an interrupted run can be longer than the source is now.
+	FILE_END_OF_FILE_INFO EndOfFile;
+	EndOfFile.EndOfFile.QuadPart = static_cast<LONGLONG>(Offset);
+	if (!SetFileInformationByHandle(ToFile.Get(), FileEndOfFileInfo, &EndOfFile, sizeof(EndOfFile)))
+	{
+		return false;
+	}
+
+	return ToFile.CloseWithReturn();
+}
+
+bool IsKnownDirectory(const std::basic_string<TCHAR>& Path)
+{
+	std::shared_lock<std::shared_mutex> Lock(__hidden_File::DirectoryMutex);
+	return __hidden_File::KnownDirectories.find(Path) != __hidden_File::KnownDirectories.end();
+}
+void AddKnownDirectory(std::basic_string<TCHAR>&& Path)
+{
+	std::unique_lock<std::shared_mutex> Lock(__hidden_File::DirectoryMutex);
+	__hidden_File::KnownDirectories.emplace(std::move(Path));
+}
+
+// Directories are remembered once they are known to exist, so files going into the same directory skip the metadata calls.
+bool CreateParentDirectory(const std::filesystem::path& ToPath)
+{
+	std::error_code Error;
+
+	const std::filesystem::path ToParentPath = ToPath.parent_path();
+	std::basic_string<TCHAR> ParentString = ToParentPath.string<TCHAR>();
+	if (IsKnownDirectory(ParentString))
+	{
+		return true;
+	}
+
+	bool bShouldCreate = true;
+	const bool bExists = std::filesystem::exists(ToParentPath, Error);
+	if (Error)
+	{
+		PushLog(_T("!!Error: Error occurred while checking if \"%s\" exists\n"), ToParentPath.string<TCHAR>().c_str());
+		return false;
+	}
+	if (bExists)
+	{
+		const bool bIsDirectory = std::filesystem::is_directory(ToParentPath, Error);
+		if (Error)
+		{
+			PushLog(_T("!!Error: Error occurred while checking if \"%s\" is a directory\n"), ToParentPath.string<TCHAR>().c_str());
+			return false;
+		}
+		if (bIsDirectory)
+		{
+			bShouldCreate = false;
+		}
+	}
+	if (bShouldCreate)
+	{
+		const bool bCreateDirectory = Profiled(ProfileOp::Mkdir, [&] { return std::filesystem::create_directories(ToParentPath, Error); });
+		if (Error)
+		{
+			PushLog(_T("!!Error: Error occurred while creating directory \"%s\"\n"), ToParentPath.string<TCHAR>().c_str());
+			return false;
+		}
+		// Another worker may have created the same directory in the meantime.
+		if (!bCreateDirectory && !std::filesystem::is_directory(ToParentPath, Error))
+		{
+			PushLog(_T("!!Error: Failed to create directory \"%s\"\n"), ToParentPath.string<TCHAR>().c_str());
+			return false;
+		}
+	}
+
+	AddKnownDirectory(std::move(ParentString));
+	return true;
+}
+
+// Creates every parent directory of "RelativePaths" below "Root" up front. Shallow directories go first, so each
+// directory needs a single create call and the copy workers later find all of them in the known set.
+// Failures are not reported here, the copy of each affected file retries the creation and reports it.
+void CreateDirectorySkeleton(const std::filesystem::path& Root, const std::vector<std::filesystem::path>& RelativePaths)
+{
+	TraceScope Trace("skeleton", "directory", Root);
+
+	std::error_code Error;
+
+	std::unordered_set<std::basic_string<TCHAR>> Seen;
+	std::vector<std::pair<size_t, std::filesystem::path>> Directories;
+	for (const auto& RelativePath : RelativePaths)
+	{
+		for (std::filesystem::path Directory = RelativePath.parent_path(); !Directory.empty(); Directory = Directory.parent_path())
+		{
+			if (!Seen.emplace(Directory.string<TCHAR>()).second)
+			{
+				break;
+			}
+			Directories.emplace_back(std::distance(Directory.begin(), Directory.end()), Directory);
+		}
+	}
+	std::sort(Directories.begin(), Directories.end(), [](const auto& Lhs, const auto& Rhs)
+	{
+		return Lhs.first < Rhs.first;
+	});
+
+	AddKnownDirectory(Root.string<TCHAR>());
+
+	for (const auto& Directory : Directories)
+	{
+		const std::filesystem::path Path = Root / Directory.second;
+		Profiled(ProfileOp::Mkdir, [&] { return std::filesystem::create_directory(Path, Error); });
+		if (!Error)
+		{
+			AddKnownDirectory(Path.string<TCHAR>());
+		}
+	}
+}
+
+struct StagedFile
+{
+	std::filesystem::path StagingPath;
+	std::filesystem::path ToPath;
+	bool bCommitted;
+};
+
+std::filesystem::path MakeStagingPath(const std::filesystem::path& ToPath)
+{
+	std::filesystem::path StagingPath = ToPath;
+	StagingPath += StagingSuffix;
+	return StagingPath;
+}
+
+// Flushes the whole volume holding "Path", which is the Windows counterpart of syncfs. Opening a volume needs administrator rights.
+bool FlushVolume(const std::filesystem::path& Path)
+{
+	if (__hidden_File::bVolumeFlushUnavailable)
+	{
+		return false;
+	}
+
+	auto Unavailable = []
+	{
+		if (!__hidden_File::bVolumeFlushUnavailable.exchange(true))
+		{
+			PushLog(LogLevel::Summary, _T("* Cannot flush the volume without administrator rights, staged files are flushed one by one\n"));
+		}
+		return false;
+	};
+
+	TCHAR MountPoint[MAX_PATH];
+	TCHAR VolumeName[MAX_PATH];
+	if (!GetVolumePathName(Path.string<TCHAR>().c_str(), MountPoint, MAX_PATH) || !GetVolumeNameForVolumeMountPoint(MountPoint, VolumeName, MAX_PATH))
+	{
+		return Unavailable();
+	}
+
+	// Volume names end with a backslash, which would open the root directory instead of the volume itself.
+	const size_t Length = _tcslen(VolumeName);
+	if ((Length > 0) && (VolumeName[Length - 1] == _T('\\')))
+	{
+		VolumeName[Length - 1] = _T('\0');
+	}
+
+	HandlePtr Volume(VolumeName, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, OPEN_EXISTING);
+	if (!Volume || !FlushFileBuffers(Volume.Get()))
+	{
+		return Unavailable();
+	}
+	return true;
+}
+bool FlushFile(const std::filesystem::path& Path)
+{
+	HandlePtr File(Path, GENERIC_WRITE, FILE_SHARE_READ, OPEN_EXISTING);
+	if (!File)
+	{
+		return false;
+	}
+	if (!FlushFileBuffers(File.Get()))
+	{
+		return false;
+	}
+	return File.CloseWithReturn();
+}
+
+// Makes a batch of staged files durable and moves them over their destinations. Data is flushed before any rename,
+// so an interrupted run leaves either the old or the new content in place, never a truncated file.
+void CommitStagedFiles(std::vector<StagedFile>& Files)
+{
+	if (Files.empty())
+	{
+		return;
+	}
+
+	// Without the volume flush every file is flushed on its own. Those flushes wait on the disk rather than the processor, so they run
+	// in parallel to let the device overlap them.
+	std::atomic<bool> bFlushed = true;
+	if (__hidden_Option::bSyncBatch && !FlushVolume(Files.front().ToPath))
+	{
+		concurrency::parallel_for(size_t(0), Files.size(), [&Files, &bFlushed](size_t i)
+		{
+			if (!FlushFile(Files[i].StagingPath))
+			{
+				PushLog(_T("!!Error: Failed to flush \"%s\"\n"), Files[i].StagingPath.string<TCHAR>().c_str());
+				bFlushed = false;
+			}
+		});
+	}
+
+	for (auto& File : Files)
+	{
+		File.bCommitted = bFlushed && MoveFileEx(File.StagingPath.string<TCHAR>().c_str(), File.ToPath.string<TCHAR>().c_str(), MOVEFILE_REPLACE_EXISTING);
+		if (!File.bCommitted)
+		{
+			PushLog(_T("!!Error: Failed to move \"%s\" to \"%s\"\n"), File.StagingPath.string<TCHAR>().c_str(), File.ToPath.string<TCHAR>().c_str());
+			DeleteFile(File.StagingPath.string<TCHAR>().c_str());
+		}
+	}
+}
+
+// With "ExpectedHash" set, the digest is computed from the data while it streams through and compared before returning.
+// The block clone and kernel paths never see the data, so they are skipped in that case.
+bool BufferFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath, CopyResult& Result, const RawHash* ExpectedHash = nullptr)
+{
+	CopyMethod& Method = Result.Method;
+
+	Method = CopyMethod::None;
+	Result.HoleBytes = 0;
+	Result.bDigestMismatch = false;
+
+	sha512_ctx CTX;
+	sha512_ctx* Digest = ExpectedHash ? &CTX : nullptr;
+
+	auto Verify = [&]() -> bool
+	{
+		if (!Digest)
+		{
+			return true;
+		}
+
+		RawHash Actual;
+		sha512_final(Digest, Actual.Raw);
+		if (!IsSameDigest(Actual, *ExpectedHash))
+		{
+			PushLog(_T("!!Error: Digest mismatch while copying \"%s\"\n"), FromPath.string<TCHAR>().c_str());
+			Result.bDigestMismatch = true;
+			return false;
+		}
+		return true;
+	};
+
+	if (!CreateParentDirectory(ToPath))
+	{
+		return false;
+	}
+
+	ThrottleFile();
+
+	if (!Digest && BlockCloneFileCopy(FromPath, ToPath))
+	{
+		Method = CopyMethod::BlockClone;
+		return true;
+	}
+
+	// One query answers both whether the sparse path applies and how large the file is, without opening it.
+	WIN32_FILE_ATTRIBUTE_DATA Attributes = {};
+	const bool bSizeKnown = GetFileAttributesEx(FromPath.string<TCHAR>().c_str(), GetFileExInfoStandard, &Attributes) != FALSE;
+	const uintmax_t Size = (static_cast<uintmax_t>(Attributes.nFileSizeHigh) << 32) | Attributes.nFileSizeLow;
+
+	if (bSizeKnown && (Attributes.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) && SparseFileCopy(FromPath, ToPath, Result.HoleBytes, Digest))
+	{
+		Method = CopyMethod::Sparse;
+		return Verify();
+	}
+
+	if (bSizeKnown && (__hidden_Option::DirectIOSize > 0) && (Size >= __hidden_Option::DirectIOSize))
+	{
+		bool bOutOfSpace = false;
+		if (DirectFileCopy(FromPath, ToPath, Digest, bOutOfSpace))
+		{
+			Method = CopyMethod::Direct;
+			return Verify();
+		}
+		if (bOutOfSpace)
+		{
+			PushLog(_T("!!Error: Not enough space to allocate \"%s\" (%.1f MiB)\n"), ToPath.string<TCHAR>().c_str(), Size / 1048576.0);
+			return false;
+		}
+	}
+	if (!Digest && KernelFileCopy(FromPath, ToPath))
+	{
+		Method = CopyMethod::Kernel;
+		return true;
+	}
+
+	FilePtr FromFile(FromPath.string<TCHAR>().c_str(), _T("rb"));
+	if (!FromFile)
+	{
+		PushLog(_T("!!Error: Cannot open \"%s\"\n"), FromPath.string<TCHAR>().c_str());
+		return false;
+	}
+
+	FilePtr ToFile(ToPath.string<TCHAR>().c_str(), _T("wb"));
+	if (!ToFile)
+	{
+		PushLog(_T("!!Error: Cannot open \"%s\"\n"), ToPath.string<TCHAR>().c_str());
+		return false;
+	}
+
+	// Small files are not worth the extra call, they rarely end up fragmented.
+	if (bSizeKnown && (Size >= __hidden_Option::SmallFileSize))
+	{
+		if (!PreallocateFile(reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(ToFile.Get()))), Size))
+		{
+			PushLog(_T("!!Error: Not enough space to allocate \"%s\" (%.1f MiB)\n"), ToPath.string<TCHAR>().c_str(), Size / 1048576.0);
+			return false;
+		}
+	}
+
+	Method = CopyMethod::Buffered;
+
+	BufferLease Buffer;
+	if (!Buffer)
+	{
+		PushLog(_T("!!Error: Failed to allocate copy buffer for \"%s\"\n"), FromPath.string<TCHAR>().c_str());
+		return false;
+	}
+
+	if (Digest)
+	{
+		sha512_init(Digest);
+	}
+
+	while (const size_t ReadSize = Profiled(ProfileOp::Read, [&] { return fread_s(Buffer.Get(), Buffer.Size(), sizeof(unsigned char), Buffer.Size(), FromFile.Get()); }))
+	{
+		if (ReadSize <= 0)
+		{
+			return true;
+		}
+		ThrottleRead(ReadSize);
+		if (Digest)
+		{
+			sha512_update(Digest, Buffer.Get(), static_cast<unsigned int>(ReadSize));
+		}
+
+		ThrottleWrite(ReadSize);
+		if (Profiled(ProfileOp::Write, [&] { return fwrite(Buffer.Get(), sizeof(unsigned char), ReadSize, ToFile.Get()); }) != ReadSize)
+		{
+			PushLog(_T("!!Error: Failed to write \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			return false;
+		}
+	}
+
+	if (!FromFile.CloseWithReturn())
+	{
+		PushLog(_T("!!Error: Cannot close file \"%s\"\n"), FromPath.string<TCHAR>().c_str());
+		return false;
+	}
+	if (!ToFile.CloseWithReturn())
+	{
+		PushLog(_T("!!Error: Cannot close file \"%s\"\n"), ToPath.string<TCHAR>().c_str());
+		return false;
+	}
+
+	return Verify();
+}
+bool BufferFileCopy(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath)
+{
+	CopyResult Result;
+	return BufferFileCopy(FromPath, ToPath, Result);
+}
+// Creates "ToPath" as a hard link to "FromPath" and falls back to a copy, for instance when both are on different volumes.
+bool LinkOrCopyFile(const std::filesystem::path& FromPath, const std::filesystem::path& ToPath, CopyResult& Result)
+{
+	DeleteFile(ToPath.string<TCHAR>().c_str());
+	if (CreateHardLink(ToPath.string<TCHAR>().c_str(), FromPath.string<TCHAR>().c_str(), nullptr))
+	{
+		Result = CopyResult{ CopyMethod::HardLink, 0, false };
+		return true;
+	}
+	return BufferFileCopy(FromPath, ToPath, Result);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+bool ConvertToHash(FilePtr& File, RawHash& Hash, uintmax_t* ByteCount = nullptr)
+{
+	ProfileScope Profile(ProfileOp::Hash);
+
+	BufferLease Buffer;
+	if (!Buffer)
+	{
+		return false;
+	}
+
+	ThrottleFile();
+
+	sha512_ctx CTX;
+	sha512_init(&CTX);
+	
+	while (const size_t Read = Profiled(ProfileOp::Read, [&] { return fread_s(Buffer.Get(), Buffer.Size(), sizeof(unsigned char), Buffer.Size(), File.Get()); }))
+	{
+		ThrottleRead(Read);
+		sha512_update(&CTX, Buffer.Get(), static_cast<unsigned int>(Read));
+		if (ByteCount)
+		{
+			*ByteCount += Read;
+		}
+	}
+	
+	sha512_final(&CTX, Hash.Raw);
+	return true;
+}
+std::basic_string<TCHAR> ConvertToString(const RawHash& Hash)
+{
+	static constexpr size_t Len = sizeof(RawHash::Raw) << 1;
+	static constexpr TCHAR Digits[] = _T("0123456789abcdef");
+	std::basic_string<TCHAR> TmpString(Len, _T('0'));
+
+	for(size_t i = 0; i < (Len >> 1); ++i)
+	{
+		TmpString[(i << 1) + 0] = Digits[(Hash.Raw[i] >> 4) & 0x0f];
+		TmpString[(i << 1) + 1] = Digits[(Hash.Raw[i] >> 0) & 0x0f];
+	}
+
+	return std::move(TmpString);
+}
+bool ConvertToHash(const std::basic_string<TCHAR>& Str, RawHash& Hash)
+{
+	if (Str.length() < (sizeof(RawHash::Raw) << 1))
+		return false;
+	
+	for (size_t i = 0; i < (sizeof(RawHash::Raw) << 1); ++i)
+	{
+		TCHAR Char = Str[i];
+		if (Char >= _T('0') && Char <= _T('9'))
+		{
+			Char -= _T('0');
+		}
+		else if (Char >= _T('a') && Char <= _T('f'))
+		{
+			Char -= _T('a') - 10;
+		}
+		else if (Char >= _T('A') && Char <= _T('F'))
+		{
+			Char -= _T('A') - 10;
+		}
+		else
+		{
+			Char = 0;
+		}
+
+		if (i & 1)
+		{
+			Hash.Raw[i >> 1] |= Char;
+		}
+		else
+		{
+			Hash.Raw[i >> 1] = Char << 4;
+		}
+	}
+
+	return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct AsyncCopyRequest
+{
+	std::filesystem::path FromPath;
+	std::filesystem::path ToPath;
+	const RawHash* ExpectedHash;
+	bool bSucceeded;
+	bool bDigestMismatch;
+};
+struct AsyncHashRequest
+{
+	std::filesystem::path Path;
+	RawHash Hash;
+	bool bSucceeded;
+	uintmax_t Size;
+};
+
+namespace __hidden_Async
+{
+	// Every file in flight owns one slot of a single leased buffer, so the queue depth is "--buffer-size / SlotSize".
+	static constexpr size_t SlotSize = 64 * 1024;
+
+	struct Operation
+	{
+		OVERLAPPED Overlapped;
+		size_t Request;
+		HandlePtr ReadFile;
+		HandlePtr WriteFile;
+		unsigned char* Slot;
+		ULONGLONG Offset;
+		DWORD Pending;
+		bool bWriting;
+		bool bHashing;
+		sha512_ctx CTX;
+		std::chrono::steady_clock::time_point StartTime;
+	};
+
+	// Starts the next transfer of "Op". Returns ERROR_SUCCESS when a completion packet will follow.
+	DWORD Issue(Operation& Op)
+	{
+		memset(&Op.Overlapped, 0, sizeof(Op.Overlapped));
+		Op.Overlapped.Offset = static_cast<DWORD>(Op.Offset);
+		Op.Overlapped.OffsetHigh = static_cast<DWORD>(Op.Offset >> 32);
+
+		const BOOL bIssued = Op.bWriting
+			? ::WriteFile(Op.WriteFile.Get(), Op.Slot, Op.Pending, nullptr, &Op.Overlapped)
+			: ::ReadFile(Op.ReadFile.Get(), Op.Slot, static_cast<DWORD>(SlotSize), nullptr, &Op.Overlapped);
+		if (bIssued)
+		{
+			return ERROR_SUCCESS;
+		}
+
+		const DWORD LastError = GetLastError();
+		return (LastError == ERROR_IO_PENDING) ? ERROR_SUCCESS : LastError;
+	}
+
+	// Drives up to "queue depth" files at once through one completion port. "Open" prepares the handles of a request,
+	// "Finish" receives the request back once its stream hit the end of file or failed.
+	// Opening and closing stay synchronous because Windows has no overlapped form of them.
+	template <typename OpenFunc, typename FinishFunc>
+	bool Run(size_t Count, bool bCopy, OpenFunc&& Open, FinishFunc&& Finish)
+	{
+		BufferLease Buffer;
+		if (!Buffer)
+		{
+			return false;
+		}
+
+		HANDLE Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+		if (!Port)
+		{
+			return false;
+		}
+
+		std::vector<Operation> Ops(std::max<size_t>(Buffer.Size() / SlotSize, 1));
+		for (size_t i = 0; i < Ops.size(); ++i)
+		{
+			Ops[i].Slot = Buffer.Get() + (i * SlotSize);
+		}
+
+		size_t Next = 0;
+		size_t InFlight = 0;
+
+		auto Complete = [&](Operation& Op, bool bSucceeded)
+		{
+			if (Op.ReadFile && !Op.ReadFile.CloseWithReturn())
+			{
+				bSucceeded = false;
+			}
+			if (Op.WriteFile && !Op.WriteFile.CloseWithReturn())
+			{
+				bSucceeded = false;
+			}
+			Finish(Op.Request, Op, bSucceeded);
+		};
+		auto Launch = [&](Operation& Op)
+		{
+			while (Next < Count)
+			{
+				Op.Request = Next++;
+				Op.StartTime = std::chrono::steady_clock::now();
+				Op.Offset = 0;
+				Op.Pending = 0;
+				Op.bWriting = false;
+				Op.bHashing = !bCopy;
+
+				ThrottleFile();
+				if (!Open(Op.Request, Op))
+				{
+					Complete(Op, false);
+					continue;
+				}
+				if (!CreateIoCompletionPort(Op.ReadFile.Get(), Port, 0, 0) || (bCopy && !CreateIoCompletionPort(Op.WriteFile.Get(), Port, 0, 0)))
+				{
+					Complete(Op, false);
+					continue;
+				}
+
+				const DWORD Result = Issue(Op);
+				if (Result == ERROR_SUCCESS)
+				{
+					++InFlight;
+					return;
+				}
+				Complete(Op, Result == ERROR_HANDLE_EOF);
+			}
+		};
+
+		for (auto& Op : Ops)
+		{
+			Launch(Op);
+		}
+
+		// Once the port fails, every pending transfer is cancelled and its packet drained, since the transfers still point into
+		// "Ops" and "Buffer".
+		bool bCancelled = false;
+		while (InFlight > 0)
+		{
+			DWORD Transferred = 0;
+			ULONG_PTR Key = 0;
+			LPOVERLAPPED Overlapped = nullptr;
+			const BOOL bDequeued = GetQueuedCompletionStatus(Port, &Transferred, &Key, &Overlapped, INFINITE);
+			if (!Overlapped)
+			{
+				if (bCancelled)
+				{
+					break;
+				}
+				bCancelled = true;
+				for (auto& Op : Ops)
+				{
+					if (Op.ReadFile)
+					{
+						CancelIoEx(Op.ReadFile.Get(), nullptr);
+					}
+					if (Op.WriteFile)
+					{
+						CancelIoEx(Op.WriteFile.Get(), nullptr);
+					}
+				}
+				continue;
+			}
+			--InFlight;
+
+			Operation& Op = *CONTAINING_RECORD(Overlapped, Operation, Overlapped);
+			if (bCancelled)
+			{
+				Complete(Op, false);
+				continue;
+			}
+
+			DWORD Result = ERROR_SUCCESS;
+			if (!bDequeued)
+			{
+				Result = GetLastError();
+			}
+			else if (Op.bWriting)
+			{
+				if (Transferred != Op.Pending)
+				{
+					Result = ERROR_DISK_FULL;
+				}
+				else
+				{
+					Op.Offset += Transferred;
+					Op.bWriting = false;
+					Result = Issue(Op);
+				}
+			}
+			else if (Transferred == 0)
+			{
+				Result = ERROR_HANDLE_EOF;
+			}
+			else if (bCopy)
+			{
+				ThrottleRead(Transferred);
+				if (Op.bHashing)
+				{
+					sha512_update(&Op.CTX, Op.Slot, static_cast<unsigned int>(Transferred));
+				}
+				ThrottleWrite(Transferred);
+				Op.Pending = Transferred;
+				Op.bWriting = true;
+				Result = Issue(Op);
+			}
+			else
+			{
+				ThrottleRead(Transferred);
+				sha512_update(&Op.CTX, Op.Slot, static_cast<unsigned int>(Transferred));
+				Op.Offset += Transferred;
+				Result = Issue(Op);
+			}
+
+			if (Result == ERROR_SUCCESS)
+			{
+				++InFlight;
+				continue;
+			}
+
+			Complete(Op, (Result == ERROR_HANDLE_EOF) && !Op.bWriting);
+			Launch(Op);
+		}
+
+		// Only left when the port failed twice. Closing the files is the last way to end their transfers.
+		for (auto& Op : Ops)
+		{
+			if ((InFlight > 0) && (Op.ReadFile || Op.WriteFile))
+			{
+				--InFlight;
+				Complete(Op, false);
+			}
+		}
+
+		CloseHandle(Port);
+		return !bCancelled;
+	}
+};
+
+// Batched counterpart of BufferFileCopy. Meant for many small files, where per-file round trips dominate the data itself.
+void AsyncFileCopy(std::vector<AsyncCopyRequest>& Requests)
+{
+	for (auto& Request : Requests)
+	{
+		Request.bSucceeded = false;
+		Request.bDigestMismatch = false;
+	}
+
+	__hidden_Async::Run(Requests.size(), true, [&Requests](size_t Index, __hidden_Async::Operation& Op)
+	{
+		const AsyncCopyRequest& Request = Requests[Index];
+
+		Op.bHashing = (Request.ExpectedHash != nullptr);
+		if (Op.bHashing)
+		{
+			sha512_init(&Op.CTX);
+		}
+
+		Op.ReadFile = HandlePtr(Request.FromPath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN);
+		if (!Op.ReadFile)
+		{
+			PushLog(_T("!!Error: Cannot open \"%s\"\n"), Request.FromPath.string<TCHAR>().c_str());
+			return false;
+		}
+		if (!CreateParentDirectory(Request.ToPath))
+		{
+			return false;
+		}
+		Op.WriteFile = HandlePtr(Request.ToPath, GENERIC_WRITE, 0, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED);
+		if (!Op.WriteFile)
+		{
+			PushLog(_T("!!Error: Cannot open \"%s\"\n"), Request.ToPath.string<TCHAR>().c_str());
+			return false;
+		}
+		return true;
+	},
+	[&Requests](size_t Index, __hidden_Async::Operation& Op, bool bSucceeded)
+	{
+		AsyncCopyRequest& Request = Requests[Index];
+		if (bSucceeded && Op.bHashing)
+		{
+			RawHash Actual;
+			sha512_final(&Op.CTX, Actual.Raw);
+			if (!IsSameDigest(Actual, *Request.ExpectedHash))
+			{
+				PushLog(_T("!!Error: Digest mismatch while copying \"%s\"\n"), Request.FromPath.string<TCHAR>().c_str());
+				Request.bDigestMismatch = true;
+				bSucceeded = false;
+			}
+		}
+		Request.bSucceeded = bSucceeded;
+
+		if (IsTraceEnabled())
+		{
+			RecordTraceSpan("copy", "file", Op.StartTime, Request.ToPath.string<TCHAR>(), true);
+		}
+	});
+}
+// Batched counterpart of ConvertToHash.
+void AsyncConvertToHash(std::vector<AsyncHashRequest>& Requests)
+{
+	for (auto& Request : Requests)
+	{
+		Request.bSucceeded = false;
+	}
+
+	__hidden_Async::Run(Requests.size(), false, [&Requests](size_t Index, __hidden_Async::Operation& Op)
+	{
+		Op.ReadFile = HandlePtr(Requests[Index].Path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN);
+		if (!Op.ReadFile)
+		{
+			return false;
+		}
+		sha512_init(&Op.CTX);
+		return true;
+	},
+	[&Requests](size_t Index, __hidden_Async::Operation& Op, bool bSucceeded)
+	{
+		if (bSucceeded)
+		{
+			sha512_final(&Op.CTX, Requests[Index].Hash.Raw);
+		}
+		Requests[Index].bSucceeded = bSucceeded;
+		Requests[Index].Size = Op.Offset;
+		AddProgress(1, Op.Offset);
+		CountMetric(MetricCounter::Hashed, 1, Op.Offset);
+
+		if (IsTraceEnabled())
+		{
+			RecordTraceSpan("hash", "file", Op.StartTime, Requests[Index].Path.string<TCHAR>(), true);
+		}
+	});
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+struct CopyJob
+{
+	std::filesystem::path RelativePath;
+	uintmax_t Size;
+	const RawHash* Hash;
+	bool bSucceeded;
+};
+struct CopyStat
+{
+	size_t FileCount;
+	uintmax_t ByteCount;
+	double Seconds;
+};
+
+// Runs "Task" over every job on "--copy-workers" threads. The largest files are started first so the run does not end on a single big copy,
+// and files below "--small-file" are grouped so one worker handles a whole batch of them per pull. "Task" receives a batch and sets "bSucceeded" of each job.
+// Plain threads are used on purpose: the workers mostly wait on I/O, and should not occupy the CPU sized PPL scheduler.
+template <typename Task>
+CopyStat ScheduleCopyJobs(std::vector<CopyJob>& Jobs, Task&& Func)
+{
+	std::sort(Jobs.begin(), Jobs.end(), [](const CopyJob& Lhs, const CopyJob& Rhs)
+	{
+		return Lhs.Size > Rhs.Size;
+	});
+
+	std::vector<std::pair<size_t, size_t>> Batches;
+	for (size_t i = 0; i < Jobs.size();)
+	{
+		size_t End = i + 1;
+		if (Jobs[i].Size < __hidden_Option::SmallFileSize)
+		{
+			End = std::min(i + __hidden_Option::SmallFileBatch, Jobs.size());
+		}
+		Batches.emplace_back(i, End);
+		i = End;
+	}
+
+	std::atomic<size_t> NextBatch = 0;
+	std::atomic<size_t> FileCount = 0;
+	std::atomic<uintmax_t> ByteCount = 0;
+
+	auto Worker = [&]()
+	{
+		for (size_t Index = NextBatch++; Index < Batches.size(); Index = NextBatch++)
+		{
+			const std::span<CopyJob> Batch(Jobs.begin() + Batches[Index].first, Jobs.begin() + Batches[Index].second);
+			for (auto& Job : Batch)
+			{
+				Job.bSucceeded = false;
+			}
+
+			Func(Batch);
+
+			for (const auto& Job : Batch)
+			{
+				if (Job.bSucceeded)
+				{
+					++FileCount;
+					ByteCount += Job.Size;
+				}
+			}
+		}
+	};
+
+	const auto StartTime = std::chrono::steady_clock::now();
+	{
+		const size_t WorkerCount = std::min(__hidden_Option::CopyWorkers, Batches.size());
+
+		std::vector<std::thread> Threads;
+		Threads.reserve(WorkerCount);
+		for (size_t i = 1; i < WorkerCount; ++i)
+		{
+			Threads.emplace_back(Worker);
+		}
+		Worker();
+
+		for (auto& Thread : Threads)
+		{
+			Thread.join();
+		}
+	}
+	const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+
+	return CopyStat{ FileCount.load(), ByteCount.load(), Elapsed.count() };
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// A pack file is the magic followed by entries of: path length (in TCHARs), path, data size, SHA-512 digest, data.
+// An index of every entry's path and offset follows the entries, and a footer of index offset, entry count and index magic
+// ends the file, so a reader can go straight to the entries it needs.
+// Packs are written next to the source manifest, so a run over a slow share opens one file per pack instead of one per small file.
+struct PackIndexEntry
+{
+	std::basic_string<TCHAR> RelativePath;
+	unsigned long long Offset;
+};
+
+namespace __hidden_Pack
+{
+	static constexpr unsigned char Magic[4] = { 'P', 'R', 'P', 'K' };
+	static constexpr unsigned char IndexMagic[4] = { 'P', 'R', 'P', 'I' };
+	static constexpr long long FooterSize = sizeof(unsigned long long) + sizeof(unsigned int) + sizeof(IndexMagic);
+};
+
+std::filesystem::path MakePackPath(const std::filesystem::path& Root, size_t Index)
+{
+	TCHAR Name[MAX_PATH];
+	_stprintf_s(Name, _T("%s%u%s"), PackFilePrefix, static_cast<unsigned>(Index), PackFileExtension);
+	return Root / Name;
+}
+bool IsPackFile(const std::filesystem::path& RelativePath)
+{
+	if (!RelativePath.parent_path().empty())
+	{
+		return false;
+	}
+
+	const std::basic_string<TCHAR> Name = RelativePath.filename().string<TCHAR>();
+	return Name.starts_with(PackFilePrefix) && Name.ends_with(PackFileExtension);
+}
+
+bool WritePackHeader(FilePtr& File)
+{
+	return fwrite(__hidden_Pack::Magic, sizeof(__hidden_Pack::Magic), 1, File.Get()) == 1;
+}
+bool ReadPackHeader(FilePtr& File)
+{
+	unsigned char Magic[sizeof(__hidden_Pack::Magic)];
+	return (fread_s(Magic, sizeof(Magic), sizeof(Magic), 1, File.Get()) == 1) && (memcmp(Magic, __hidden_Pack::Magic, sizeof(Magic)) == 0);
+}
+
+bool WritePackEntry(FilePtr& File, const std::basic_string<TCHAR>& RelativePath, const std::vector<unsigned char>& Data, const RawHash& Hash)
+{
+	const unsigned int PathLength = static_cast<unsigned int>(RelativePath.size());
+	const unsigned long long Size = Data.size();
+
+	if (fwrite(&PathLength, sizeof(PathLength), 1, File.Get()) != 1)
+	{
+		return false;
+	}
+	if (fwrite(RelativePath.data(), sizeof(TCHAR), PathLength, File.Get()) != PathLength)
+	{
+		return false;
+	}
+	if (fwrite(&Size, sizeof(Size), 1, File.Get()) != 1)
+	{
+		return false;
+	}
+	if (fwrite(Hash.Raw, SHA512_DIGEST_SIZE, 1, File.Get()) != 1)
+	{
+		return false;
+	}
+	return Profiled(ProfileOp::Write, [&] { return fwrite(Data.data(), sizeof(unsigned char), Data.size(), File.Get()); }) == Data.size();
+}
+// Reads the entry at the current position. Returns false when the pack is truncated or damaged.
+bool ReadPackEntry(FilePtr& File, std::basic_string<TCHAR>& RelativePath, std::vector<unsigned char>& Data, RawHash& Hash)
+{
+	unsigned int PathLength = 0;
+	if ((fread_s(&PathLength, sizeof(PathLength), sizeof(PathLength), 1, File.Get()) != 1) || (PathLength > MaxPathLength))
+	{
+		return false;
+	}
+
+	RelativePath.resize(PathLength);
+	if (fread_s(RelativePath.data(), PathLength * sizeof(TCHAR), sizeof(TCHAR), PathLength, File.Get()) != PathLength)
+	{
+		return false;
+	}
+
+	unsigned long long Size = 0;
+	if (fread_s(&Size, sizeof(Size), sizeof(Size), 1, File.Get()) != 1)
+	{
+		return false;
+	}
+	if (fread_s(Hash.Raw, sizeof(Hash.Raw), SHA512_DIGEST_SIZE, 1, File.Get()) != 1)
+	{
+		return false;
+	}
+
+	// A damaged size must not turn into an allocation larger than what is left of the pack.
+	const long long Position = _ftelli64(File.Get());
+	const long long Length = _filelengthi64(_fileno(File.Get()));
+	if ((Position < 0) || (Length < Position) || (Size > static_cast<unsigned long long>(Length - Position)))
+	{
+		return false;
+	}
+
+	Data.resize(static_cast<size_t>(Size));
+	return Profiled(ProfileOp::Read, [&] { return fread_s(Data.data(), Data.size(), sizeof(unsigned char), Data.size(), File.Get()); }) == Data.size();
+}
+
+bool WritePackIndex(FilePtr& File, const std::vector<PackIndexEntry>& Entries)
+{
+	const long long IndexOffset = _ftelli64(File.Get());
+	if (IndexOffset < 0)
+	{
+		return false;
+	}
+
+	for (const auto& Entry : Entries)
+	{
+		const unsigned int PathLength = static_cast<unsigned int>(Entry.RelativePath.size());
+		if ((fwrite(&PathLength, sizeof(PathLength), 1, File.Get()) != 1) || (fwrite(Entry.RelativePath.data(), sizeof(TCHAR), PathLength, File.Get()) != PathLength)
+			|| (fwrite(&Entry.Offset, sizeof(Entry.Offset), 1, File.Get()) != 1))
+		{
+			return false;
+		}
+	}
+
+	const unsigned long long Offset = static_cast<unsigned long long>(IndexOffset);
+	const unsigned int Count = static_cast<unsigned int>(Entries.size());
+	return (fwrite(&Offset, sizeof(Offset), 1, File.Get()) == 1) && (fwrite(&Count, sizeof(Count), 1, File.Get()) == 1)
+		&& (fwrite(__hidden_Pack::IndexMagic, sizeof(__hidden_Pack::IndexMagic), 1, File.Get()) == 1);
+}
+// Leaves the position undefined, the caller seeks to the entries it wants.
+bool ReadPackIndex(FilePtr& File, std::vector<PackIndexEntry>& Entries)
+{
+	Entries.clear();
+
+	const long long Length = _filelengthi64(_fileno(File.Get()));
+	if ((Length < __hidden_Pack::FooterSize) || (_fseeki64(File.Get(), Length - __hidden_Pack::FooterSize, SEEK_SET) != 0))
+	{
+		return false;
+	}
+
+	unsigned long long IndexOffset = 0;
+	unsigned int Count = 0;
+	unsigned char Magic[sizeof(__hidden_Pack::IndexMagic)];
+	if ((fread_s(&IndexOffset, sizeof(IndexOffset), sizeof(IndexOffset), 1, File.Get()) != 1) || (fread_s(&Count, sizeof(Count), sizeof(Count), 1, File.Get()) != 1)
+		|| (fread_s(Magic, sizeof(Magic), sizeof(Magic), 1, File.Get()) != 1) || (memcmp(Magic, __hidden_Pack::IndexMagic, sizeof(Magic)) != 0))
+	{
+		return false;
+	}
+
+	// Every index entry takes at least its length and offset, which bounds a damaged count before anything is reserved.
+	const unsigned long long IndexEnd = static_cast<unsigned long long>(Length - __hidden_Pack::FooterSize);
+	if ((IndexOffset > IndexEnd) || (Count > ((IndexEnd - IndexOffset) / (sizeof(unsigned int) + sizeof(unsigned long long))))
+		|| (_fseeki64(File.Get(), static_cast<long long>(IndexOffset), SEEK_SET) != 0))
+	{
+		return false;
+	}
+
+	Entries.resize(Count);
+	for (auto& Entry : Entries)
+	{
+		unsigned int PathLength = 0;
+		if ((fread_s(&PathLength, sizeof(PathLength), sizeof(PathLength), 1, File.Get()) != 1) || (PathLength > MaxPathLength))
+		{
+			return false;
+		}
+		Entry.RelativePath.resize(PathLength);
+		if ((fread_s(Entry.RelativePath.data(), PathLength * sizeof(TCHAR), sizeof(TCHAR), PathLength, File.Get()) != PathLength)
+			|| (fread_s(&Entry.Offset, sizeof(Entry.Offset), sizeof(Entry.Offset), 1, File.Get()) != 1) || (Entry.Offset >= IndexOffset))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void RemovePackFiles(const std::filesystem::path& Root)
+{
+	std::error_code Error;
+
+	for (size_t i = 0;; ++i)
+	{
+		const std::filesystem::path PackPath = MakePackPath(Root, i);
+		if (!std::filesystem::remove(PackPath, Error))
+		{
+			break;
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+enum class DiffState : unsigned char
+{
+	Added,
+	Modified,
+	Unchanged,
+	Deleted,
+};
+
+// "Hash" is the source digest, or the destination digest of a deleted entry. Entries point into the manifests they were made from,
+// or into the plan they were read from, which keeps digests of added and modified entries only.
+struct DiffEntry
+{
+	const std::filesystem::path* RelativePath;
+	const RawHash* Hash;
+	DiffState State;
+};
+
+// Result of comparing the source manifest with the destination manifest. The source keys stay sharded as they were
+// during the comparison, so membership tests later on look into a single small set.
+struct UpdatePlan
+{
+	std::vector<DiffEntry> Entries;
+	size_t Counts[static_cast<size_t>(DiffState::Deleted) + 1];
+	std::vector<std::unordered_set<std::basic_string<TCHAR>>> SourceKeys;
+
+	std::deque<std::filesystem::path> OwnedPaths;
+	std::deque<RawHash> OwnedHashes;
+};
+
+namespace __hidden_Diff
+{
+	struct Item
+	{
+		std::basic_string<TCHAR> Key;
+		const std::filesystem::path* RelativePath;
+		const RawHash* Hash;
+		size_t Shard;
+	};
+
+	// Paths compare as the file system does, case-insensitively and regardless of the separator, without asking the file system.
+	// Case is folded by the invariant locale like NTFS folds names, beyond ASCII and independent of the C runtime locale.
+	std::basic_string<TCHAR> MakeKey(const std::filesystem::path& RelativePath)
+	{
+		const std::basic_string<TCHAR> Path = RelativePath.lexically_normal().make_preferred().string<TCHAR>();
+		if (Path.empty())
+		{
+			return Path;
+		}
+
+		std::basic_string<TCHAR> Key(Path.size(), _T('\0'));
+		const int Length = LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, Path.data(), static_cast<int>(Path.size()), Key.data(), static_cast<int>(Key.size()), nullptr, nullptr, 0);
+		if (Length <= 0)
+		{
+			return Path;
+		}
+		Key.resize(static_cast<size_t>(Length));
+		return Key;
+	}
+	size_t GetShard(const std::basic_string<TCHAR>& Key, size_t ShardCount)
+	{
+		return std::hash<std::basic_string<TCHAR>>()(Key) % ShardCount;
+	}
+
+	std::vector<Item> MakeItems(const PathMap<RawHash>& Hashes, size_t ShardCount)
+	{
+		std::vector<Item> Items;
+		Items.reserve(Hashes.size());
+		for (const auto& Wrapped : Hashes)
+		{
+			Items.emplace_back(Item{ {}, &Wrapped.first, &Wrapped.second, 0 });
+		}
+		concurrency::parallel_for(size_t(0), Items.size(), [&Items, ShardCount](size_t i)
+		{
+			Items[i].Key = MakeKey(*Items[i].RelativePath);
+			Items[i].Shard = GetShard(Items[i].Key, ShardCount);
+		});
+		return Items;
+	}
+	std::vector<std::vector<size_t>> SplitItems(const std::vector<Item>& Items, size_t ShardCount)
+	{
+		std::vector<std::vector<size_t>> Shards(ShardCount);
+		for (size_t i = 0; i < Items.size(); ++i)
+		{
+			Shards[Items[i].Shard].emplace_back(i);
+		}
+		return Shards;
+	}
+};
+
+// Sorts every entry of both manifests into added, modified, unchanged and deleted in one parallel pass. Entries are split into
+// shards by their key first, and each shard is compared on its own.
+UpdatePlan MakeUpdatePlan(const PathMap<RawHash>& SrcHashes, const PathMap<RawHash>& DestHashes)
+{
+	const size_t ShardCount = std::max<size_t>(std::thread::hardware_concurrency(), 1) * 8;
+
+	std::vector<__hidden_Diff::Item> SrcItems = __hidden_Diff::MakeItems(SrcHashes, ShardCount);
+	std::vector<__hidden_Diff::Item> DestItems = __hidden_Diff::MakeItems(DestHashes, ShardCount);
+	const std::vector<std::vector<size_t>> SrcShards = __hidden_Diff::SplitItems(SrcItems, ShardCount);
+	const std::vector<std::vector<size_t>> DestShards = __hidden_Diff::SplitItems(DestItems, ShardCount);
+
+	UpdatePlan Plan;
+	Plan.SourceKeys.resize(ShardCount);
+
+	std::vector<std::vector<DiffEntry>> ShardEntries(ShardCount);
+	concurrency::parallel_for(size_t(0), ShardCount, [&](size_t Shard)
+	{
+		std::unordered_map<std::basic_string<TCHAR>, __hidden_Diff::Item*> DestIndex;
+		DestIndex.reserve(DestShards[Shard].size());
+		for (const size_t i : DestShards[Shard])
+		{
+			DestIndex.emplace(DestItems[i].Key, &DestItems[i]);
+		}
+
+		std::vector<DiffEntry>& Entries = ShardEntries[Shard];
+		Entries.reserve(SrcShards[Shard].size());
+		for (const size_t i : SrcShards[Shard])
+		{
+			__hidden_Diff::Item& Src = SrcItems[i];
+
+			DiffState State = DiffState::Added;
+			auto Found = DestIndex.find(Src.Key);
+			if (Found != DestIndex.end())
+			{
+				State = IsSameDigest(*Found->second->Hash, *Src.Hash) ? DiffState::Unchanged : DiffState::Modified;
+				DestIndex.erase(Found);
+			}
+			Entries.emplace_back(DiffEntry{ Src.RelativePath, Src.Hash, State });
+
+			Plan.SourceKeys[Shard].emplace(std::move(Src.Key));
+		}
+		for (const auto& Remaining : DestIndex)
+		{
+			Entries.emplace_back(DiffEntry{ Remaining.second->RelativePath, Remaining.second->Hash, DiffState::Deleted });
+		}
+	});
+
+	std::fill(std::begin(Plan.Counts), std::end(Plan.Counts), 0);
+	Plan.Entries.reserve(SrcItems.size() + DestItems.size());
+	for (auto& Entries : ShardEntries)
+	{
+		for (const auto& Entry : Entries)
+		{
+			++Plan.Counts[static_cast<size_t>(Entry.State)];
+		}
+		Plan.Entries.insert(Plan.Entries.end(), Entries.begin(), Entries.end());
+	}
+	return Plan;
+}
+bool IsPlannedSource(const UpdatePlan& Plan, const std::filesystem::path& RelativePath)
+{
+	const std::basic_string<TCHAR> Key = __hidden_Diff::MakeKey(RelativePath);
+	const auto& Keys = Plan.SourceKeys[__hidden_Diff::GetShard(Key, Plan.SourceKeys.size())];
+	return Keys.find(Key) != Keys.end();
+}
+bool IsPlannedUpdate(const DiffEntry& Entry)
+{
+	return (Entry.State == DiffState::Added) || (Entry.State == DiffState::Modified);
+}
+// Marks an entry as brought up to date before the update phase, by reusing destination content or by an interrupted update.
+void SetPlannedDone(UpdatePlan& Plan, DiffEntry& Entry)
+{
+	--Plan.Counts[static_cast<size_t>(Entry.State)];
+	++Plan.Counts[static_cast<size_t>(DiffState::Unchanged)];
+	Entry.State = DiffState::Unchanged;
+}
+size_t GetPlannedUpdateCount(const UpdatePlan& Plan)
+{
+	return Plan.Counts[static_cast<size_t>(DiffState::Added)] + Plan.Counts[static_cast<size_t>(DiffState::Modified)];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// A plan file is the comparison of one source with one destination state, made once and applied to every destination in that state:
+// a header naming both manifests by digest, the expected totals, then every entry with its state and relative path. Added and
+// modified entries also carry their digest and size.
+struct PlanSummary
+{
+	RawHash SrcManifest;
+	RawHash DestManifest;
+	uintmax_t TransferBytes;
+	double EstimatedSeconds;
+};
+
+namespace __hidden_Plan
+{
+	static constexpr unsigned char Magic[4] = { 'P', 'R', 'P', 'L' };
+	static constexpr unsigned int Version = 1;
+
+	// A rough model to compare plans with, per created or removed file and per byte at a nominal transfer rate.
+	static constexpr double UpdateSeconds = 0.002;
+	static constexpr double RemoveSeconds = 0.0005;
+	static constexpr double BytesPerSecond = 100.0 * 1024 * 1024;
+
+	template <typename T>
+	bool Write(FilePtr& File, const T& Value)
+	{
+		return fwrite(&Value, sizeof(T), 1, File.Get()) == 1;
+	}
+	template <typename T>
+	bool Read(FilePtr& File, T& Value)
+	{
+		return fread_s(&Value, sizeof(T), sizeof(T), 1, File.Get()) == 1;
+	}
+};
+
+// A missing manifest has the zero digest, a destination without one is planned as empty.
+bool HashManifest(const std::filesystem::path& Path, RawHash& Hash)
+{
+	std::error_code Error;
+
+	memset(Hash.Raw, 0, sizeof(Hash.Raw));
+	if (!std::filesystem::exists(Path, Error))
+	{
+		return !Error;
+	}
+
+	FilePtr File(Path, _T("rb"));
+	if (!File)
+	{
+		return false;
+	}
+	return ConvertToHash(File, Hash) && File.CloseWithReturn();
+}
+
+bool WriteUpdatePlan(const std::filesystem::path& PlanPath, const UpdatePlan& Plan, const std::filesystem::path& SrcPath, PlanSummary& Summary)
+{
+	std::vector<unsigned long long> Sizes(Plan.Entries.size(), 0);
+	concurrency::parallel_for(size_t(0), Plan.Entries.size(), [&](size_t i)
+	{
+		if (IsPlannedUpdate(Plan.Entries[i]))
+		{
+			std::error_code Error;
+			const uintmax_t Size = std::filesystem::file_size(SrcPath / *Plan.Entries[i].RelativePath, Error);
+			Sizes[i] = Error ? 0 : Size;
+		}
+	});
+
+	Summary.TransferBytes = 0;
+	for (const unsigned long long Size : Sizes)
+	{
+		Summary.TransferBytes += Size;
+	}
+	Summary.EstimatedSeconds = GetPlannedUpdateCount(Plan) * __hidden_Plan::UpdateSeconds + Plan.Counts[static_cast<size_t>(DiffState::Deleted)] * __hidden_Plan::RemoveSeconds
+		+ Summary.TransferBytes / __hidden_Plan::BytesPerSecond;
+
+	std::filesystem::path TmpPath = PlanPath;
+	TmpPath += StagingSuffix;
+
+	bool bWritten = false;
+	{
+		FilePtr File(TmpPath, _T("wb"));
+		if (!File)
+		{
+			return false;
+		}
+
+		bWritten = (fwrite(__hidden_Plan::Magic, sizeof(__hidden_Plan::Magic), 1, File.Get()) == 1) && __hidden_Plan::Write(File, __hidden_Plan::Version)
+			&& (fwrite(Summary.SrcManifest.Raw, SHA512_DIGEST_SIZE, 1, File.Get()) == 1) && (fwrite(Summary.DestManifest.Raw, SHA512_DIGEST_SIZE, 1, File.Get()) == 1)
+			&& __hidden_Plan::Write(File, static_cast<unsigned long long>(Summary.TransferBytes)) && __hidden_Plan::Write(File, Summary.EstimatedSeconds)
+			&& __hidden_Plan::Write(File, static_cast<unsigned long long>(Plan.Entries.size()));
+		for (size_t i = 0; bWritten && (i < Plan.Entries.size()); ++i)
+		{
+			const DiffEntry& Entry = Plan.Entries[i];
+			const std::basic_string<TCHAR> RelativePath = Entry.RelativePath->string<TCHAR>();
+			const unsigned int PathLength = static_cast<unsigned int>(RelativePath.size());
+
+			bWritten = __hidden_Plan::Write(File, Entry.State) && __hidden_Plan::Write(File, PathLength)
+				&& (fwrite(RelativePath.data(), sizeof(TCHAR), PathLength, File.Get()) == PathLength);
+			if (bWritten && IsPlannedUpdate(Entry))
+			{
+				bWritten = (fwrite(Entry.Hash->Raw, SHA512_DIGEST_SIZE, 1, File.Get()) == 1) && __hidden_Plan::Write(File, Sizes[i]);
+			}
+		}
+		bWritten = File.CloseWithReturn() && bWritten;
+	}
+	if (!bWritten)
+	{
+		DeleteFile(TmpPath.string<TCHAR>().c_str());
+		return false;
+	}
+	return MoveFileEx(TmpPath.string<TCHAR>().c_str(), PlanPath.string<TCHAR>().c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+// Entries of the read plan point into its own storage. The source keys are rebuilt from them, so the plan stands in for the
+// comparison completely. Every path is checked against the loaded source manifest, a plan naming anything else is rejected.
+bool ReadUpdatePlan(const std::filesystem::path& PlanPath, const PathMap<RawHash>& SrcHashes, UpdatePlan& Plan, PlanSummary& Summary)
+{
+	FilePtr File(PlanPath, _T("rb"));
+	if (!File)
+	{
+		return false;
+	}
+
+	unsigned char Magic[sizeof(__hidden_Plan::Magic)];
+	unsigned int Version = 0;
+	if ((fread_s(Magic, sizeof(Magic), sizeof(Magic), 1, File.Get()) != 1) || (memcmp(Magic, __hidden_Plan::Magic, sizeof(Magic)) != 0))
+	{
+		return false;
+	}
+	if (!__hidden_Plan::Read(File, Version) || (Version != __hidden_Plan::Version))
+	{
+		return false;
+	}
+
+	memset(Summary.SrcManifest.Raw, 0, sizeof(Summary.SrcManifest.Raw));
+	memset(Summary.DestManifest.Raw, 0, sizeof(Summary.DestManifest.Raw));
+	unsigned long long TransferBytes = 0;
+	unsigned long long EntryCount = 0;
+	if ((fread_s(Summary.SrcManifest.Raw, sizeof(Summary.SrcManifest.Raw), SHA512_DIGEST_SIZE, 1, File.Get()) != 1)
+		|| (fread_s(Summary.DestManifest.Raw, sizeof(Summary.DestManifest.Raw), SHA512_DIGEST_SIZE, 1, File.Get()) != 1)
+		|| !__hidden_Plan::Read(File, TransferBytes) || !__hidden_Plan::Read(File, Summary.EstimatedSeconds) || !__hidden_Plan::Read(File, EntryCount))
+	{
+		return false;
+	}
+	Summary.TransferBytes = TransferBytes;
+
+	const size_t ShardCount = std::max<size_t>(std::thread::hardware_concurrency(), 1) * 8;
+
+	std::unordered_map<std::basic_string<TCHAR>, const RawHash*> SrcIndex;
+	SrcIndex.reserve(SrcHashes.size());
+	for (auto& Item : __hidden_Diff::MakeItems(SrcHashes, ShardCount))
+	{
+		SrcIndex.emplace(std::move(Item.Key), Item.Hash);
+	}
+
+	size_t SourceCount = 0;
+	Plan.Entries.clear();
+	Plan.OwnedPaths.clear();
+	Plan.OwnedHashes.clear();
+	Plan.SourceKeys.assign(ShardCount, {});
+	std::fill(std::begin(Plan.Counts), std::end(Plan.Counts), 0);
+
+	std::basic_string<TCHAR> RelativePath;
+	for (unsigned long long i = 0; i < EntryCount; ++i)
+	{
+		DiffEntry Entry{ nullptr, nullptr, DiffState::Unchanged };
+		unsigned int PathLength = 0;
+		if (!__hidden_Plan::Read(File, Entry.State) || (static_cast<size_t>(Entry.State) > static_cast<size_t>(DiffState::Deleted)) || !__hidden_Plan::Read(File, PathLength))
+		{
+			return false;
+		}
+		if ((PathLength == 0) || (PathLength > MaxPathLength))
+		{
+			return false;
+		}
+		RelativePath.resize(PathLength);
+		if (fread_s(RelativePath.data(), PathLength * sizeof(TCHAR), sizeof(TCHAR), PathLength, File.Get()) != PathLength)
+		{
+			return false;
+		}
+		if (IsPlannedUpdate(Entry))
+		{
+			RawHash& Hash = Plan.OwnedHashes.emplace_back();
+			memset(Hash.Raw, 0, sizeof(Hash.Raw));
+			unsigned long long Size = 0;
+			if ((fread_s(Hash.Raw, sizeof(Hash.Raw), SHA512_DIGEST_SIZE, 1, File.Get()) != 1) || !__hidden_Plan::Read(File, Size))
+			{
+				return false;
+			}
+			Entry.Hash = &Hash;
+		}
+		Entry.RelativePath = &Plan.OwnedPaths.emplace_back(RelativePath);
+
+		// Plan paths are joined to the destination, so none may leave it.
+		if (Entry.RelativePath->has_root_path())
+		{
+			return false;
+		}
+		for (const auto& Part : *Entry.RelativePath)
+		{
+			if (Part == _T(".."))
+			{
+				return false;
+			}
+		}
+
+		if (Entry.State != DiffState::Deleted)
+		{
+			std::basic_string<TCHAR> Key = __hidden_Diff::MakeKey(*Entry.RelativePath);
+			auto Found = SrcIndex.find(Key);
+			if ((Found == SrcIndex.end()) || (Entry.Hash && !IsSameDigest(*Entry.Hash, *Found->second)))
+			{
+				return false;
+			}
+
+			const size_t Shard = __hidden_Diff::GetShard(Key, ShardCount);
+			if (!Plan.SourceKeys[Shard].emplace(std::move(Key)).second)
+			{
+				return false;
+			}
+			++SourceCount;
+		}
+		++Plan.Counts[static_cast<size_t>(Entry.State)];
+		Plan.Entries.emplace_back(Entry);
+	}
+	if (SourceCount != SrcHashes.size())
+	{
+		return false;
+	}
+	return File.CloseWithReturn();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// The journal lives at the destination while an update runs and is removed once the manifest is committed. Each line is
+// "done<TAB>size<TAB>write time<TAB>hash<TAB>path" for a committed file or "part<TAB>offset<TAB>0<TAB>hash<TAB>path" for a checkpoint.
+namespace __hidden_Journal
+{
+	struct Entry
+	{
+		uintmax_t Value;
+		long long WriteTime;
+		RawHash Hash;
+	};
+
+	static std::mutex Mutex;
+	static FILE* File = nullptr;
+	static std::unordered_map<std::basic_string<TCHAR>, Entry> Done;
+	static std::unordered_map<std::basic_string<TCHAR>, Entry> Parts;
+
+	long long GetWriteTime(const std::filesystem::path& Path)
+	{
+		std::error_code Error;
+
+		const std::filesystem::file_time_type WriteTime = std::filesystem::last_write_time(Path, Error);
+		return Error ? 0 : static_cast<long long>(WriteTime.time_since_epoch().count());
+	}
+
+	void WriteRecord(const TCHAR* Kind, const std::basic_string<TCHAR>& RelativePath, uintmax_t Value, long long WriteTime, const RawHash& Hash)
+	{
+		_ftprintf_s(File, _T("%s\t%llu\t%lld\t%s\t%s\n"), Kind, static_cast<unsigned long long>(Value), WriteTime, ConvertToString(Hash).c_str(), RelativePath.c_str());
+	}
+};
+
+// Loads the journal an interrupted update left behind. A torn last line is expected after a crash and is skipped.
+size_t ReadJournal(const std::filesystem::path& DestPath)
+{
+	const std::filesystem::path JournalPath(DestPath / JournalFileName);
+	FilePtr JournalFile(JournalPath, _T("rt, ccs=UTF-8"));
+	if (!JournalFile)
+	{
+		return 0;
+	}
+
+	size_t Count = 0;
+	while (!feof(JournalFile.Get()))
+	{
+		const std::basic_string<TCHAR> Line = ReadFileStringLine(JournalFile);
+
+		size_t Fields[4];
+		size_t Position = 0;
+		bool bValid = true;
+		for (auto& Field : Fields)
+		{
+			Position = Line.find(_T('\t'), Position);
+			if (Position == std::basic_string<TCHAR>::npos)
+			{
+				bValid = false;
+				break;
+			}
+			Field = Position++;
+		}
+		if (!bValid || (Position >= Line.size()))
+		{
+			continue;
+		}
+
+		__hidden_Journal::Entry CurEntry;
+		CurEntry.Value = static_cast<uintmax_t>(_tcstoull(Line.c_str() + Fields[0] + 1, nullptr, 10));
+		CurEntry.WriteTime = static_cast<long long>(_tcstoll(Line.c_str() + Fields[1] + 1, nullptr, 10));
+		if (!ConvertToHash(Line.substr(Fields[2] + 1, Fields[3] - Fields[2] - 1), CurEntry.Hash))
+		{
+			continue;
+		}
+
+		std::basic_string<TCHAR> RelativePath = Line.substr(Fields[3] + 1);
+		const std::basic_string<TCHAR> Kind = Line.substr(0, Fields[0]);
+		if (Kind == _T("done"))
+		{
+			__hidden_Journal::Parts.erase(RelativePath);
+			__hidden_Journal::Done.insert_or_assign(std::move(RelativePath), CurEntry);
+		}
+		else if (Kind == _T("part"))
+		{
+			__hidden_Journal::Parts.insert_or_assign(std::move(RelativePath), CurEntry);
+		}
+		else
+		{
+			continue;
+		}
+		++Count;
+	}
+
+	return Count;
+}
+// Paths an interrupted update committed, and paths it left a checkpointed staging file for.
+void ListJournaledPaths(std::vector<std::basic_string<TCHAR>>& DonePaths, std::vector<std::basic_string<TCHAR>>& PartPaths)
+{
+	for (const auto& Wrapped : __hidden_Journal::Done)
+	{
+		DonePaths.emplace_back(Wrapped.first);
+	}
+	for (const auto& Wrapped : __hidden_Journal::Parts)
+	{
+		PartPaths.emplace_back(Wrapped.first);
+	}
+}
+bool OpenJournal(const std::filesystem::path& DestPath)
+{
+	if (__hidden_Journal::File)
+	{
+		return true;
+	}
+
+	const std::filesystem::path JournalPath(DestPath / JournalFileName);
+	_tfopen_s(&__hidden_Journal::File, JournalPath.string<TCHAR>().c_str(), _T("at, ccs=UTF-8"));
+	return __hidden_Journal::File != nullptr;
+}
+bool IsJournalOpen()
+{
+	return __hidden_Journal::File != nullptr;
+}
+void CloseJournal(const std::filesystem::path& DestPath, bool bRemove)
+{
+	std::error_code Error;
+
+	if (__hidden_Journal::File)
+	{
+		fclose(__hidden_Journal::File);
+		__hidden_Journal::File = nullptr;
+	}
+	if (bRemove)
+	{
+		std::filesystem::remove(DestPath / JournalFileName, Error);
+	}
+
+	__hidden_Journal::Done.clear();
+	__hidden_Journal::Parts.clear();
+}
+
+// A committed file is trusted only while it still has the size and write time recorded after its commit, which also catches a rename
+// that was lost while its journal line survived.
+bool IsJournaledFile(const std::filesystem::path& DestPath, const std::basic_string<TCHAR>& RelativePath, const RawHash& Hash)
+{
+	std::error_code Error;
+
+	auto Found = __hidden_Journal::Done.find(RelativePath);
+	if ((Found == __hidden_Journal::Done.end()) || !IsSameDigest(Found->second.Hash, Hash))
+	{
+		return false;
+	}
+
+	const std::filesystem::path ToPath = DestPath / RelativePath;
+	const uintmax_t Size = std::filesystem::file_size(ToPath, Error);
+	if (Error || (Size != Found->second.Value))
+	{
+		return false;
+	}
+	return __hidden_Journal::GetWriteTime(ToPath) == Found->second.WriteTime;
+}
+// Returns where the copy of "RelativePath" can continue, or 0 when there is no usable checkpoint for this content.
+uintmax_t GetJournalOffset(const std::basic_string<TCHAR>& RelativePath, const RawHash& Hash, const std::filesystem::path& StagingPath)
+{
+	std::error_code Error;
+
+	auto Found = __hidden_Journal::Parts.find(RelativePath);
+	if ((Found == __hidden_Journal::Parts.end()) || !IsSameDigest(Found->second.Hash, Hash))
+	{
+		return 0;
+	}
+
+	const uintmax_t Size = std::filesystem::file_size(StagingPath, Error);
+	if (Error || (Size < Found->second.Value))
+	{
+		return 0;
+	}
+	return Found->second.Value;
+}
+// Tells whether a staging file at the destination still holds a checkpoint and therefore must survive the removal phase.
+bool IsJournaledStaging(const std::basic_string<TCHAR>& RelativePath)
+{
+	static constexpr size_t SuffixLength = std::size(StagingSuffix) - 1;
+	if ((RelativePath.size() <= SuffixLength) || (RelativePath.compare(RelativePath.size() - SuffixLength, SuffixLength, StagingSuffix) != 0))
+	{
+		return false;
+	}
+	return __hidden_Journal::Parts.find(RelativePath.substr(0, RelativePath.size() - SuffixLength)) != __hidden_Journal::Parts.end();
+}
+
+void WriteJournalFile(const std::basic_string<TCHAR>& RelativePath, uintmax_t Size, const RawHash& Hash, const std::filesystem::path& ToPath)
+{
+	if (!__hidden_Journal::File)
+	{
+		return;
+	}
+
+	const long long WriteTime = __hidden_Journal::GetWriteTime(ToPath);
+
+	std::lock_guard<std::mutex> Lock(__hidden_Journal::Mutex);
+	__hidden_Journal::WriteRecord(_T("done"), RelativePath, Size, WriteTime, Hash);
+}
+void WriteJournalCheckpoint(const std::basic_string<TCHAR>& RelativePath, uintmax_t Offset, const RawHash& Hash)
+{
+	if (!__hidden_Journal::File)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> Lock(__hidden_Journal::Mutex);
+	__hidden_Journal::WriteRecord(_T("part"), RelativePath, Offset, 0, Hash);
+	fflush(__hidden_Journal::File);
+}
+void FlushJournal()
+{
+	if (!__hidden_Journal::File)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> Lock(__hidden_Journal::Mutex);
+	fflush(__hidden_Journal::File);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// The store keeps each file content once as objects/<first two digits>/<digest> and each deployed version as versions/<name>.pr, a copy of
+// its manifest. Deployed files are hard links to their objects, so a kept version costs no data and a rollback only relinks. Updates never
+// write an object in place, since they stage a new file and rename it over the old one, but anything else writing into a deployed file
+// changes its object too. Objects are therefore checked against their digest before a rollback links them.
+namespace __hidden_Store
+{
+	static constexpr TCHAR ObjectDirectory[] = _T("objects");
+	static constexpr TCHAR VersionDirectory[] = _T("versions");
+	static constexpr TCHAR VersionExtension[] = _T(".pr");
+
+	typedef std::vector<std::pair<std::basic_string<TCHAR>, RawHash>> Manifest;
+
+	bool IsSameManifest(const Manifest& Lhs, const Manifest& Rhs)
+	{
+		return std::equal(Lhs.begin(), Lhs.end(), Rhs.begin(), Rhs.end(), [](const Manifest::value_type& L, const Manifest::value_type& R)
+		{
+			return (L.first == R.first) && IsSameDigest(L.second, R.second);
+		});
+	}
+};
+
+bool IsStoreEnabled()
+{
+	return !__hidden_Option::StorePath.empty();
+}
+bool IsInsideStore(const std::filesystem::path& Path)
+{
+	if (!IsStoreEnabled())
+	{
+		return false;
+	}
+
+	const std::basic_string<TCHAR> Store = __hidden_Option::StorePath.string<TCHAR>();
+	const std::basic_string<TCHAR> Target = Path.string<TCHAR>();
+	if ((Target.size() < Store.size()) || (_tcsnicmp(Target.c_str(), Store.c_str(), Store.size()) != 0))
+	{
+		return false;
+	}
+	return (Target.size() == Store.size()) || (Target[Store.size()] == _T('\\')) || (Target[Store.size()] == _T('/'));
+}
+std::filesystem::path MakeObjectPath(const RawHash& Hash)
+{
+	const std::basic_string<TCHAR> Digest = ConvertToString(Hash).substr(0, SHA512_DIGEST_SIZE << 1);
+	return __hidden_Option::StorePath / __hidden_Store::ObjectDirectory / Digest.substr(0, 2) / Digest;
+}
+std::filesystem::path MakeVersionPath(const std::basic_string<TCHAR>& Version)
+{
+	std::filesystem::path VersionPath = __hidden_Option::StorePath / __hidden_Store::VersionDirectory / Version;
+	VersionPath += __hidden_Store::VersionExtension;
+	return VersionPath;
+}
+
+// Both paths name one file when they share the volume and the file index, as a deployed file still linked to its object does.
+bool IsSameFile(const std::filesystem::path& Lhs, const std::filesystem::path& Rhs)
+{
+	HandlePtr LhsFile(Lhs, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, OPEN_EXISTING);
+	HandlePtr RhsFile(Rhs, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, OPEN_EXISTING);
+	if (!LhsFile || !RhsFile)
+	{
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION LhsInfo;
+	BY_HANDLE_FILE_INFORMATION RhsInfo;
+	if (!GetFileInformationByHandle(LhsFile.Get(), &LhsInfo) || !GetFileInformationByHandle(RhsFile.Get(), &RhsInfo))
+	{
+		return false;
+	}
+	return (LhsInfo.dwVolumeSerialNumber == RhsInfo.dwVolumeSerialNumber) && (LhsInfo.nFileIndexHigh == RhsInfo.nFileIndexHigh) && (LhsInfo.nFileIndexLow == RhsInfo.nFileIndexLow);
+}
+bool IsIntactObject(const RawHash& Hash)
+{
+	RawHash Actual;
+	FilePtr File(MakeObjectPath(Hash), _T("rb"));
+	return File && ConvertToHash(File, Actual) && IsSameDigest(Actual, Hash);
+}
+
+bool ReadManifest(const std::filesystem::path& Path, __hidden_Store::Manifest& Entries)
+{
+	FilePtr File(Path, _T("rt, ccs=UTF-8"));
+	if (!File)
+	{
+		return false;
+	}
+
+	while (!feof(File.Get()))
+	{
+		ProfileScope Profile(ProfileOp::ManifestParse);
+
+		std::basic_string<TCHAR> RelativePath = ReadFileStringLine(File);
+		if (RelativePath.empty())
+		{
+			continue;
+		}
+
+		RawHash Hash;
+		if (!ConvertToHash(ReadFileStringLine(File), Hash))
+		{
+			return false;
+		}
+		Entries.emplace_back(std::move(RelativePath), Hash);
+	}
+
+	return File.CloseWithReturn();
+}
+// Versions are named after the time they were added, so sorting by name sorts them from the oldest to the newest.
+std::vector<std::basic_string<TCHAR>> ListVersions()
+{
+	std::error_code Error;
+
+	std::vector<std::basic_string<TCHAR>> Versions;
+	for (const auto& Entry : std::filesystem::directory_iterator(__hidden_Option::StorePath / __hidden_Store::VersionDirectory, Error))
+	{
+		if (Entry.path().extension() == __hidden_Store::VersionExtension)
+		{
+			Versions.emplace_back(Entry.path().stem().string<TCHAR>());
+		}
+	}
+	std::sort(Versions.begin(), Versions.end());
+	return Versions;
+}
+std::basic_string<TCHAR> MakeVersionName()
+{
+	std::error_code Error;
+
+	const std::time_t Now = std::time(nullptr);
+	std::tm Local;
+	localtime_s(&Local, &Now);
+
+	TCHAR Name[32];
+	_tcsftime(Name, std::size(Name), _T("%Y%m%d-%H%M%S"), &Local);
+
+	std::basic_string<TCHAR> Version(Name);
+	for (unsigned Suffix = 2; std::filesystem::exists(MakeVersionPath(Version), Error); ++Suffix)
+	{
+		_stprintf_s(Name, _T("%s-%u"), Version.substr(0, 15).c_str(), Suffix);
+		Version = Name;
+	}
+	return Version;
+}
+
+// Makes sure the content of a deployed file is kept as an object, normally by linking the object to the deployed file.
+bool StoreObject(const std::filesystem::path& FilePath, const RawHash& Hash, bool& bAdded)
+{
+	std::error_code Error;
+
+	bAdded = false;
+
+	const std::filesystem::path ObjectPath = MakeObjectPath(Hash);
+	const bool bExists = std::filesystem::exists(ObjectPath, Error);
+	if (Error)
+	{
+		return false;
+	}
+	if (bExists)
+	{
+		return true;
+	}
+
+	// The deployed file only becomes object "Hash" once its content proves it, a damaged file would otherwise stay in every version.
+	{
+		RawHash Actual;
+		FilePtr File(FilePath, _T("rb"));
+		if (!File || !ConvertToHash(File, Actual) || !File.CloseWithReturn())
+		{
+			return false;
+		}
+		if (!IsSameDigest(Actual, Hash))
+		{
+			PushLog(_T("!!Error: Digest mismatch of \"%s\"\n"), FilePath.string<TCHAR>().c_str());
+			return false;
+		}
+	}
+
+	if (!CreateParentDirectory(ObjectPath))
+	{
+		return false;
+	}
+
+	const std::filesystem::path StagingPath = MakeStagingPath(ObjectPath);
+	CopyResult Result;
+	if (!LinkOrCopyFile(FilePath, StagingPath, Result) || !MoveFileEx(StagingPath.string<TCHAR>().c_str(), ObjectPath.string<TCHAR>().c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFile(StagingPath.string<TCHAR>().c_str());
+		return false;
+	}
+
+	bAdded = true;
+	return true;
+}
+
+// Records the manifest at "DestPath" as a new version and stores the files it refers to. Versions beyond KeepVersions are dropped
+// together with the objects no kept version refers to. Returns the number of errors.
+size_t UpdateVersionStore(const std::filesystem::path& DestPath)
+{
+	std::error_code Error;
+
+	const std::filesystem::path ManifestPath = DestPath / HashFileName;
+	__hidden_Store::Manifest Entries;
+	if (!ReadManifest(ManifestPath, Entries))
+	{
+		PushLog(_T("!!Error: Cannot read \"%s\"\n"), ManifestPath.string<TCHAR>().c_str());
+		return 1;
+	}
+
+	std::atomic<size_t> ErrorCount = 0;
+	std::atomic<size_t> AddedCount = 0;
+	concurrency::parallel_for_each(Entries.begin(), Entries.end(), [&](const __hidden_Store::Manifest::value_type& Entry)
+	{
+		bool bAdded = false;
+		if (!StoreObject(DestPath / Entry.first, Entry.second, bAdded))
+		{
+			PushLog(_T("!!Error: Failed to store \"%s\"\n"), (DestPath / Entry.first).string<TCHAR>().c_str());
+			++ErrorCount;
+			return;
+		}
+		if (bAdded)
+		{
+			++AddedCount;
+		}
+	});
+	PushLog(_T("* %u new object(s) stored\n"), static_cast<unsigned>(AddedCount));
+
+	// A version with missing objects could not be rolled back to.
+	if (ErrorCount > 0)
+	{
+		return ErrorCount;
+	}
+
+	std::vector<std::basic_string<TCHAR>> Versions = ListVersions();
+
+	__hidden_Store::Manifest Latest;
+	if (!Versions.empty() && ReadManifest(MakeVersionPath(Versions.back()), Latest) && __hidden_Store::IsSameManifest(Latest, Entries))
+	{
+		PushLog(_T("* Same as version \"%s\"\n"), Versions.back().c_str());
+	}
+	else
+	{
+		const std::basic_string<TCHAR> Version = MakeVersionName();
+		const std::filesystem::path VersionPath = MakeVersionPath(Version);
+
+		std::vector<StagedFile> Staged{ StagedFile{ MakeStagingPath(VersionPath), VersionPath, false } };
+		if (!CreateParentDirectory(VersionPath) || !BufferFileCopy(ManifestPath, Staged.front().StagingPath))
+		{
+			PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), ManifestPath.string<TCHAR>().c_str(), VersionPath.string<TCHAR>().c_str());
+			DeleteFile(Staged.front().StagingPath.string<TCHAR>().c_str());
+			return 1;
+		}
+		CommitStagedFiles(Staged);
+		if (!Staged.front().bCommitted)
+		{
+			return 1;
+		}
+
+		PushLog(_T("* Version \"%s\" added\n"), Version.c_str());
+		Versions.emplace_back(Version);
+	}
+
+	std::unordered_set<std::basic_string<TCHAR>> KeptObjects;
+	size_t RemovedVersions = 0;
+	for (size_t i = 0; i < Versions.size(); ++i)
+	{
+		const std::filesystem::path VersionPath = MakeVersionPath(Versions[i]);
+		if ((i + __hidden_Option::KeepVersions) < Versions.size())
+		{
+			if (!std::filesystem::remove(VersionPath, Error))
+			{
+				PushLog(_T("!!Error: Failed to remove \"%s\"\n"), VersionPath.string<TCHAR>().c_str());
+				++ErrorCount;
+				continue;
+			}
+			PushLog(_T("%s\n"), VersionPath.string<TCHAR>().c_str());
+			++RemovedVersions;
+			continue;
+		}
+
+		// Objects are only collected when every kept version is known to be complete.
+		__hidden_Store::Manifest Kept;
+		if (!ReadManifest(VersionPath, Kept))
+		{
+			PushLog(_T("!!Error: Cannot read \"%s\"\n"), VersionPath.string<TCHAR>().c_str());
+			return ErrorCount + 1;
+		}
+		for (const auto& Entry : Kept)
+		{
+			KeptObjects.emplace(MakeObjectPath(Entry.second).filename().string<TCHAR>());
+		}
+	}
+
+	std::vector<std::filesystem::path> Garbage;
+	for (const auto& Entry : std::filesystem::recursive_directory_iterator(__hidden_Option::StorePath / __hidden_Store::ObjectDirectory, Error))
+	{
+		if (Entry.is_regular_file(Error) && (KeptObjects.find(Entry.path().filename().string<TCHAR>()) == KeptObjects.end()))
+		{
+			Garbage.emplace_back(Entry.path());
+		}
+	}
+	size_t RemovedObjects = 0;
+	for (const auto& Path : Garbage)
+	{
+		if (std::filesystem::remove(Path, Error))
+		{
+			++RemovedObjects;
+		}
+	}
+
+	if ((RemovedVersions > 0) || (RemovedObjects > 0))
+	{
+		PushLog(_T("* %u old version(s) and %u unreferenced object(s) removed\n"), static_cast<unsigned>(RemovedVersions), static_cast<unsigned>(RemovedObjects));
+	}
+	return ErrorCount;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void CreateHash(const std::filesystem::path& SrcPath)
+{
+	PhaseScope TotalPhase("total");
+	std::error_code Error;
+	
+	PathSet PathsToExclude;
+	std::deque<std::filesystem::path> PathsToHashMaking;
+	
+	const std::filesystem::path ListPath(SrcPath / ListFileName);
+	FilePtr ListFile(ListPath, _T("rt, ccs=UTF-8"));
+	if (!ListFile)
+	{
+		PushLog(_T("!!Error: Cannot open \"%s\"\n"), ListPath.string<TCHAR>().c_str());
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+
+	const std::filesystem::path HashPath(SrcPath / HashFileName);
+	std::filesystem::remove(HashPath, Error);
+	if (Error)
+	{
+		PushLog(_T("!!Error: Cannot delete \"%s\"\n"), HashPath.string<TCHAR>().c_str());
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+	
+	FilePtr HashFile(HashPath, _T("wt, ccs=UTF-8"));
+	if (!HashFile)
+	{
+		PushLog(_T("!!Error: Cannot open \"%s\"\n"), HashPath.string<TCHAR>().c_str());
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+
+	size_t TotalErrorCount = 0;
+
+	{
+		PushLog(_T("\n* Read file list to making hash:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("scan");
+		
+		SetCurrentDirectory(SrcPath.string<TCHAR>().c_str());
+		while (!feof(ListFile.Get()))
+		{
+			// Each list entry counts as one scan, whole directory trees included.
+			ProfileScope Profile(ProfileOp::Scan);
+			TraceScope Trace("scan", "directory");
+
+			bool bExclude;
+			std::filesystem::path CurPath(ReadFileLine(ListFile, bExclude));
+			if (CurPath.empty())
+			{
+				continue;
+			}
+			Trace.SetDetail(CurPath);
+			const bool bExists = std::filesystem::exists(CurPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Cannot check the existence of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			if (!bExists)
+			{
 				PushLog(_T("!!Error: No such file or directory \"%s\"\n"), CurPath.string<TCHAR>().c_str());
 				++LocalErrorCount;
 				continue;
 			}
 
-			bool bIsDirectory = std::filesystem::is_directory(CurPath, Error);
-			if (Error)
+			bool bIsDirectory = std::filesystem::is_directory(CurPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			if (bIsDirectory)
+			{
+				for (auto const& ChildPath : std::filesystem::recursive_directory_iterator{ CurPath })
+				{
+					bIsDirectory = std::filesystem::is_directory(ChildPath, Error);
+					if (Error)
+					{
+						PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), ChildPath.path().string<TCHAR>().c_str());
+						++LocalErrorCount;
+						continue;
+					}
+					if (bIsDirectory)
+					{
+						continue;
+					}
+
+					const std::filesystem::path RelativeChildPath = std::filesystem::relative(ChildPath, SrcPath, Error);
+					if (Error)
+					{
+						PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), ChildPath.path().string<TCHAR>().c_str());
+						++LocalErrorCount;
+						continue;
+					}
+
+					bool bEqual = std::filesystem::equivalent(RelativeChildPath, HashFileName, Error);
+					if (Error)
+					{
+						PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativeChildPath.string<TCHAR>().c_str(), HashFileName);
+						++LocalErrorCount;
+						continue;
+					}
+					if (bEqual)
+					{
+						continue;
+					}
+
+					bEqual = std::filesystem::equivalent(RelativeChildPath, LogFileName, Error);
+					if (Error)
+					{
+						PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativeChildPath.string<TCHAR>().c_str(), LogFileName);
+						++LocalErrorCount;
+						continue;
+					}
+					if (bEqual)
+					{
+						continue;
+					}
+					if (IsPackFile(RelativeChildPath))
+					{
+						continue;
+					}
+
+					if (bExclude)
+					{
+						PathsToExclude.emplace(ChildPath);
+					}
+					else
+					{
+						PathsToHashMaking.emplace_back(ChildPath);
+					}
+				}
+			}
+			else
+			{
+				if (bExclude)
+				{
+					PathsToExclude.emplace(std::move(CurPath));
+				}
+				else
+				{
+					PathsToHashMaking.emplace_back(std::move(CurPath));
+				}
+			}
+		}
+		if (!ListFile.CloseWithReturn())
+		{
+			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), ListPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(PathsToHashMaking.size(), 0, LocalErrorCount);
+		CountMetric(MetricCounter::Scanned, PathsToHashMaking.size(), 0);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		if (PathsToHashMaking.empty())
+		{
+			PushLog(_T("* No file\n"));
+		}
+		else
+		{
+			PushLog(_T("* %u file(s) found\n"), static_cast<unsigned>(PathsToHashMaking.size()));
+		}
+	}
+
+	if (PathsToHashMaking.empty())
+	{
+		TotalPhase.SetResult(0, 0, TotalErrorCount);
+		return;
+	}
+	
+	{
+		PushLog(_T("\n* Following files will be hashed:\n"));
+		PhaseScope Phase("filter");
+		
+		for (auto It = PathsToHashMaking.begin(); It != PathsToHashMaking.end();)
+		{
+			if (PathsToExclude.find(*It) != PathsToExclude.end())
+			{
+				It = PathsToHashMaking.erase(It);
+			}
+			else
+			{
+				PushLog(_T("%s\n"), It->string<TCHAR>().c_str());
+				++It;
+			}
+		}
+		
+		Phase.SetResult(PathsToHashMaking.size(), 0, 0);
+		PushLog(_T("\n"));
+	}
+
+	{
+		PushLog(_T("\n* Hash making started:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("hash");
+		ProgressScope Progress(_T("hash"), PathsToHashMaking.size(), 0);
+		uintmax_t HashedBytes = 0;
+		
+		std::vector<AsyncHashRequest> HashRequests;
+		if (__hidden_Option::Backend == IOBackend::Async)
+		{
+			HashRequests.reserve(PathsToHashMaking.size());
+			for (const auto& Path : PathsToHashMaking)
+			{
+				HashRequests.emplace_back(AsyncHashRequest{ Path, {}, false, 0 });
+			}
+			AsyncConvertToHash(HashRequests);
+		}
+
+		std::basic_string<TCHAR> TmpString;
+		size_t HashIndex = 0;
+		for (const auto& Path : PathsToHashMaking)
+		{
+			RawHash Hash;
+			if (!HashRequests.empty())
+			{
+				const AsyncHashRequest& Request = HashRequests[HashIndex++];
+				if (!Request.bSucceeded)
+				{
+					PushLog(_T("!!Error: Failed to hash \"%s\"\n"), Path.string<TCHAR>().c_str());
+					memset(Hash.Raw, 0xff, sizeof(RawHash::Raw));
+					++LocalErrorCount;
+				}
+				else
+				{
+					Hash = Request.Hash;
+				}
+				HashedBytes += Request.Size;
+
+				// Requests overlap, so no single file owns a duration.
+				EmitFileEvent("hash", Path, Request.Size, 0.0, Request.bSucceeded ? ERROR_SUCCESS : ERROR_READ_FAULT);
+			}
+			else
+			{
+				TraceScope Trace("hash", "file", Path);
+
+				const auto StartTime = std::chrono::steady_clock::now();
+				uintmax_t FileBytes = 0;
+				unsigned long FileError = ERROR_SUCCESS;
+
+				FilePtr CurFile(Path, _T("rb"));
+				if (!CurFile)
+				{
+					FileError = GetLastError();
+					PushLog(_T("!!Error: Cannot open \"%s\"\n"), Path.string<TCHAR>().c_str());
+					memset(Hash.Raw, 0xff, sizeof(RawHash::Raw));
+					++LocalErrorCount;
+				}
+				else if (!ConvertToHash(CurFile, Hash, &FileBytes))
+				{
+					FileError = ERROR_NOT_ENOUGH_MEMORY;
+					PushLog(_T("!!Error: Failed to allocate hash buffer for \"%s\"\n"), Path.string<TCHAR>().c_str());
+					memset(Hash.Raw, 0xff, sizeof(RawHash::Raw));
+					++LocalErrorCount;
+				}
+
+				if (!CurFile.CloseWithReturn())
+				{
+					PushLog(_T("!!Error: Failed to close file \"%s\"\n"), Path.string<TCHAR>().c_str());
+					++LocalErrorCount;
+				}
+				HashedBytes += FileBytes;
+				AddProgress(1, FileBytes);
+				CountMetric(MetricCounter::Hashed, 1, FileBytes);
+
+				const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+				EmitFileEvent("hash", Path, FileBytes, Elapsed.count(), FileError);
+			}
+
+			TmpString = std::filesystem::relative(Path, SrcPath, Error).string<TCHAR>();
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), Path.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			
+			TmpString += _T("\n");
+			TmpString += ConvertToString(Hash);
+			TmpString += _T("\n");
+
+			_fputts(TmpString.c_str(), HashFile.Get());
+		}
+		if (!HashFile.CloseWithReturn())
+		{
+			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), HashPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(PathsToHashMaking.size(), HashedBytes, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		PushLog(_T("* Done\n"));
+	}
+
+	RemovePackFiles(SrcPath);
+	if (__hidden_Option::PackFileSize > 0)
+	{
+		PushLog(_T("\n* Pack small files:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("pack");
+
+		size_t PackedCount = 0;
+		size_t PackCount = 0;
+		size_t PackBytes = 0;
+		uintmax_t PackedBytes = 0;
+
+		FilePtr PackFile;
+		std::vector<PackIndexEntry> PackEntries;
+		auto ClosePack = [&]() -> bool
+		{
+			const bool bIndexed = WritePackIndex(PackFile, PackEntries);
+			PackEntries.clear();
+			return PackFile.CloseWithReturn() && bIndexed;
+		};
+
+		std::vector<unsigned char> Data;
+		for (const auto& Path : PathsToHashMaking)
+		{
+			const uintmax_t Size = std::filesystem::file_size(Path, Error);
+			if (Error || (Size >= __hidden_Option::PackFileSize))
+			{
+				continue;
+			}
+
+			const std::basic_string<TCHAR> RelativePath = std::filesystem::relative(Path, SrcPath, Error).string<TCHAR>();
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), Path.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+
+			{
+				FilePtr CurFile(Path, _T("rb"));
+				if (!CurFile)
+				{
+					PushLog(_T("!!Error: Cannot open \"%s\"\n"), Path.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					continue;
+				}
+
+				ThrottleFile();
+
+				Data.resize(static_cast<size_t>(Size));
+				if (Profiled(ProfileOp::Read, [&] { return fread_s(Data.data(), Data.size(), sizeof(unsigned char), Data.size(), CurFile.Get()); }) != Data.size())
+				{
+					PushLog(_T("!!Error: Failed to read \"%s\"\n"), Path.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					continue;
+				}
+				ThrottleRead(Data.size());
+			}
+
+			// The digest is taken from the packed bytes themselves, so a file that changed after hashing is caught when unpacking.
+			RawHash Hash;
+			{
+				sha512_ctx CTX;
+				sha512_init(&CTX);
+				sha512_update(&CTX, Data.data(), static_cast<unsigned int>(Data.size()));
+				sha512_final(&CTX, Hash.Raw);
+			}
+
+			if (!PackFile || ((PackBytes + Data.size()) > __hidden_Option::PackSize))
+			{
+				if (PackFile && !ClosePack())
+				{
+					PushLog(_T("!!Error: Failed to close file \"%s\"\n"), MakePackPath(SrcPath, PackCount - 1).string<TCHAR>().c_str());
+					++LocalErrorCount;
+				}
+
+				const std::filesystem::path PackPath = MakePackPath(SrcPath, PackCount++);
+				PackFile = FilePtr(PackPath, _T("wb"));
+				if (!PackFile || !WritePackHeader(PackFile))
+				{
+					PushLog(_T("!!Error: Cannot write \"%s\"\n"), PackPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					break;
+				}
+				PackBytes = 0;
+			}
+
+			ThrottleWrite(Data.size());
+			PackEntries.emplace_back(PackIndexEntry{ RelativePath, static_cast<unsigned long long>(_ftelli64(PackFile.Get())) });
+			if (!WritePackEntry(PackFile, RelativePath, Data, Hash))
+			{
+				PushLog(_T("!!Error: Failed to pack \"%s\"\n"), Path.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				break;
+			}
+			PackBytes += Data.size();
+			PackedBytes += Data.size();
+			++PackedCount;
+			EmitFileEvent("pack", Path, Data.size(), 0.0, ERROR_SUCCESS);
+		}
+		if (PackFile && !ClosePack())
+		{
+			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), MakePackPath(SrcPath, PackCount - 1).string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(PackedCount, PackedBytes, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			// A half written pack set is worse than none, copies simply fall back to individual files.
+			RemovePackFiles(SrcPath);
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		else
+		{
+			PushLog(_T("* %u file(s) packed into %u pack(s)\n"), static_cast<unsigned>(PackedCount), static_cast<unsigned>(PackCount));
+		}
+	}
+
+	TotalPhase.SetResult(PathsToHashMaking.size(), 0, TotalErrorCount);
+	if (TotalErrorCount > 0)
+	{
+		PushLog(_T("\n* %u error occurred in total\n"), static_cast<unsigned>(TotalErrorCount));
+	}
+	else
+	{
+		PushLog(_T("\n* All tasks done successfully\n"));
+	}
+}
+
+void CopyPackage(const std::filesystem::path& SrcPath, const std::filesystem::path& DestPath)
+{
+	PhaseScope TotalPhase("total");
+	std::error_code Error;
+	
+	const std::filesystem::path ListPath(SrcPath / ListFileName);
+	FilePtr ListFile(ListPath, _T("rt, ccs=UTF-8"));
+	if (!ListFile)
+	{
+		PushLog(_T("!!Error: Cannot open \"%s\"\n"), ListPath.string<TCHAR>().c_str());
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+
+	const std::filesystem::path SrcHashPath(SrcPath / HashFileName);
+	FilePtr SrcHashFile(SrcHashPath, _T("rt, ccs=UTF-8"));
+	if (!SrcHashFile)
+	{
+		PushLog(_T("!!Error: Cannot open \"%s\"\n"), SrcHashPath.string<TCHAR>().c_str());
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+	
+	const std::filesystem::path DestHashPath(DestPath / HashFileName);
+	FilePtr DestHashFile(DestHashPath, _T("rt, ccs=UTF-8"));
+
+	size_t TotalErrorCount = 0;
+
+	std::deque<std::filesystem::path> ExcludeForDeletion;
+	{
+		PushLog(_T("\n* Read list for excluding from update:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("read_list");
+		
+		SetCurrentDirectory(SrcPath.string<TCHAR>().c_str());
+		
+		while (!feof(ListFile.Get()))
+		{
+			bool bExclude;
+			std::filesystem::path CurPath(ReadFileLine(ListFile, bExclude));
+			if (CurPath.empty())
+			{
+				continue;
+			}
+			if (!bExclude)
+			{
+				continue;
+			}
+			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, SrcPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			
+			ExcludeForDeletion.emplace_back(std::move(RelativePath));
+		}
+		if (!ListFile.CloseWithReturn())
+		{
+			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), ListPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(ExcludeForDeletion.size(), 0, LocalErrorCount);
+		if (ExcludeForDeletion.empty())
+		{
+			PushLog(_T("* No files or directories\n"));
+		}
+		else
+		{
+			PushLog(_T("* %u files or directories found\n"), static_cast<unsigned>(ExcludeForDeletion.size()));
+		}
+	}
+
+	PathMap<RawHash> DestHashes;
+	if (DestHashFile)
+	{
+		PushLog(_T("\n* Read destination file hash:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("read_dest_manifest");
+		
+		SetCurrentDirectory(DestPath.string<TCHAR>().c_str());
+
+		while (!feof(DestHashFile.Get()))
+		{
+			ProfileScope Profile(ProfileOp::ManifestParse);
+
+			std::filesystem::path CurPath(ReadFileLine(DestHashFile));
+			if (CurPath.empty())
+			{
+				continue;
+			}
+			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, DestPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			if (CheckIfFileContained(ExcludeForDeletion, RelativePath))
+			{
+				continue;
+			}
+
+			RawHash CurHash;
+			if (!ConvertToHash(ReadFileStringLine(DestHashFile), CurHash))
+			{
+				PushLog(_T("!!Error: Invalid hash format \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+
+			DestHashes.emplace(std::move(RelativePath), std::move(CurHash));
+		}
+		if (!DestHashFile.CloseWithReturn())
+		{
+			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), DestHashPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(DestHashes.size(), 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		if (DestHashes.empty())
+		{
+			PushLog(_T("* No file hash\n"));	
+		}
+		else
+		{
+			PushLog(_T("* %u file hash found\n"), static_cast<unsigned>(DestHashes.size()));
+		}
+	}
+
+	PathMap<RawHash> SrcHashes;
+	{
+		PushLog(_T("\n* Read source file hash:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("read_src_manifest");
+		
+		SetCurrentDirectory(SrcPath.string<TCHAR>().c_str());
+
+		while (!feof(SrcHashFile.Get()))
+		{
+			ProfileScope Profile(ProfileOp::ManifestParse);
+
+			std::filesystem::path CurPath(ReadFileLine(SrcHashFile));
+			if (CurPath.empty())
+			{
+				continue;
+			}
+			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, SrcPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			if (CheckIfFileContained(ExcludeForDeletion, RelativePath))
+			{
+				continue;
+			}
+
+			RawHash CurHash;
+			if (!ConvertToHash(ReadFileStringLine(SrcHashFile), CurHash))
+			{
+				PushLog(_T("!!Error: Invalid hash format \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+
+			SrcHashes.emplace(std::move(RelativePath), std::move(CurHash));
+		}
+		if (!SrcHashFile.CloseWithReturn())
+		{
+			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), SrcHashPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(SrcHashes.size(), 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		if (SrcHashes.empty())
+		{
+			PushLog(_T("* No file hash\n"));	
+		}
+		else
+		{
+			PushLog(_T("* %u file hash found\n"), static_cast<unsigned>(SrcHashes.size()));
+		}
+	}
+
+	if (std::filesystem::exists(DestPath / JournalFileName, Error))
+	{
+		PushLog(_T("\n* Read journal of an interrupted update:\n"));
+		PhaseScope Phase("read_journal");
+
+		const size_t JournalCount = ReadJournal(DestPath);
+		Phase.SetResult(JournalCount, 0, 0);
+		PushLog(_T("* %u journal entries found\n"), static_cast<unsigned>(JournalCount));
+	}
+
+	UpdatePlan Plan;
+	if (!__hidden_Option::ApplyPath.empty())
+	{
+		PushLog(_T("\n* Read update plan:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("read_plan");
+
+		// The plan only holds for the manifests it was made from, any other destination state needs its own comparison.
+		PlanSummary Summary;
+		RawHash SrcManifest;
+		RawHash DestManifest;
+		if (!ReadUpdatePlan(__hidden_Option::ApplyPath, SrcHashes, Plan, Summary))
+		{
+			PushLog(_T("!!Error: Invalid plan \"%s\"\n"), __hidden_Option::ApplyPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+		else if (!HashManifest(SrcHashPath, SrcManifest) || !HashManifest(DestHashPath, DestManifest))
+		{
+			PushLog(_T("!!Error: Failed to calculate hash of \"%s\" or \"%s\"\n"), SrcHashPath.string<TCHAR>().c_str(), DestHashPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+		else if (!IsSameDigest(SrcManifest, Summary.SrcManifest) || !IsSameDigest(DestManifest, Summary.DestManifest))
+		{
+			PushLog(_T("!!Error: Plan \"%s\" was made for other manifests\n"), __hidden_Option::ApplyPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+
+		Phase.SetResult(Plan.Entries.size(), 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+
+			TotalPhase.SetResult(0, 0, TotalErrorCount);
+			PushLog(_T("\n* %u error occurred in total\n"), static_cast<unsigned>(TotalErrorCount));
+			return;
+		}
+		PushLog(_T("* %u added, %u modified, %u deleted, %u unchanged\n"), static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Added)]), static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Modified)]),
+			static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Deleted)]), static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Unchanged)]));
+		PushLog(_T("* %.1f MiB planned, estimated %.1f s\n"), Summary.TransferBytes / 1048576.0, Summary.EstimatedSeconds);
+	}
+	else
+	{
+		PushLog(_T("\n* Compare source and destination file hash:\n"));
+		PhaseScope Phase("diff");
+
+		Plan = MakeUpdatePlan(SrcHashes, DestHashes);
+
+		Phase.SetResult(Plan.Entries.size(), 0, 0);
+		PushLog(_T("* %u added, %u modified, %u deleted, %u unchanged\n"), static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Added)]), static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Modified)]),
+			static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Deleted)]), static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Unchanged)]));
+	}
+
+	// With "--plan" the comparison is only written out, the destination stays untouched.
+	if (!__hidden_Option::PlanPath.empty())
+	{
+		PushLog(_T("\n* Write update plan:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("write_plan");
+
+		PlanSummary Summary;
+		if (!HashManifest(SrcHashPath, Summary.SrcManifest) || !HashManifest(DestHashPath, Summary.DestManifest))
+		{
+			PushLog(_T("!!Error: Failed to calculate hash of \"%s\" or \"%s\"\n"), SrcHashPath.string<TCHAR>().c_str(), DestHashPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+		else if (!WriteUpdatePlan(__hidden_Option::PlanPath, Plan, SrcPath, Summary))
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::PlanPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+		else
+		{
+			PushLog(_T("* %u file(s) to update and %u to remove, %.1f MiB to transfer, estimated %.1f s\n"), static_cast<unsigned>(GetPlannedUpdateCount(Plan)),
+				static_cast<unsigned>(Plan.Counts[static_cast<size_t>(DiffState::Deleted)]), Summary.TransferBytes / 1048576.0, Summary.EstimatedSeconds);
+		}
+
+		Phase.SetResult(Plan.Entries.size(), 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		PushLog(_T("* Done\n"));
+
+		TotalPhase.SetResult(0, 0, TotalErrorCount);
+		if (TotalErrorCount > 0)
+		{
+			PushLog(_T("\n* %u error occurred in total\n"), static_cast<unsigned>(TotalErrorCount));
+		}
+		else
+		{
+			PushLog(_T("\n* All tasks done successfully\n"));
+		}
+		return;
+	}
+
+	// Content the destination already holds under another path is moved or copied there locally instead of being transferred again.
+	// This runs before the removal phase, which would otherwise delete the old location of a renamed file first.
+	if (!DestHashes.empty())
+	{
+		struct LocalCopy
+		{
+			DiffEntry* Entry;
+			const std::filesystem::path* OldPath;
+			bool bMove;
+		};
+
+		DigestMap<const std::filesystem::path*> DestPathsByDigest;
+		for (const auto& Wrapped : DestHashes)
+		{
+			DestPathsByDigest.emplace(Wrapped.second, &Wrapped.first);
+		}
+
+		// An old path that no longer exists on the source is moved once, every other user of the same content copies it.
+		std::vector<LocalCopy> LocalCopies;
+		std::unordered_set<std::basic_string<TCHAR>> ClaimedPaths;
+		for (auto& Entry : Plan.Entries)
+		{
+			if (!IsPlannedUpdate(Entry))
+			{
+				continue;
+			}
+
+			auto Found = DestPathsByDigest.find(*Entry.Hash);
+			if (Found == DestPathsByDigest.end())
 			{
-				PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), CurPath.string<TCHAR>().c_str());
-				++LocalErrorCount;
 				continue;
 			}
-			if (bIsDirectory)
+			if (IsJournaledFile(DestPath, Entry.RelativePath->string<TCHAR>(), *Entry.Hash))
 			{
-				for (auto const& ChildPath : std::filesystem::recursive_directory_iterator{ CurPath })
+				continue;
+			}
+
+			const std::filesystem::path& OldPath = *Found->second;
+			const bool bVacated = !IsPlannedSource(Plan, OldPath);
+			LocalCopies.emplace_back(LocalCopy{ &Entry, &OldPath, bVacated && ClaimedPaths.emplace(OldPath.string<TCHAR>()).second });
+		}
+
+		if (!LocalCopies.empty())
+		{
+			PushLog(_T("\n* Reuse files already at destination:\n"));
+			PhaseScope Phase("reuse");
+
+			if (!OpenJournal(DestPath))
+			{
+				PushLog(_T("* Journal unavailable, an interrupted update will start over\n"));
+			}
+
+			std::vector<StagedFile> Staged;
+			std::vector<std::pair<const LocalCopy*, bool>> StagedCopies;
+
+			// The destination manifest is only committed by a run without errors, so after a failed run an old path can already hold
+			// other content. Each old path is hashed once before its content is reused.
+			std::unordered_map<const std::filesystem::path*, bool> VerifiedPaths;
+			auto IsVerified = [&VerifiedPaths](const LocalCopy& Copy, const std::filesystem::path& FromPath)
+			{
+				auto Found = VerifiedPaths.find(Copy.OldPath);
+				if (Found == VerifiedPaths.end())
 				{
-					bIsDirectory = std::filesystem::is_directory(ChildPath, Error);
-					if (Error)
+					RawHash Actual;
+					FilePtr File(FromPath, _T("rb"));
+					const bool bMatched = File && ConvertToHash(File, Actual) && IsSameDigest(Actual, *Copy.Entry->Hash);
+					Found = VerifiedPaths.emplace(Copy.OldPath, bMatched).first;
+				}
+				return Found->second;
+			};
+
+			// Copies go first, the source of a move is gone afterwards.
+			for (const bool bMovePass : { false, true })
+			{
+				for (const auto& Copy : LocalCopies)
+				{
+					if (Copy.bMove != bMovePass)
 					{
-						PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), ChildPath.path().string<TCHAR>().c_str());
-						++LocalErrorCount;
 						continue;
 					}
-					if (bIsDirectory)
+
+					const std::filesystem::path FromPath = DestPath / *Copy.OldPath;
+					if (!IsVerified(Copy, FromPath))
 					{
 						continue;
 					}
-
-					const std::filesystem::path RelativeChildPath = std::filesystem::relative(ChildPath, SrcPath, Error);
-					if (Error)
+					const std::filesystem::path ToPath = DestPath / *Copy.Entry->RelativePath;
+					const std::filesystem::path StagingPath = MakeStagingPath(ToPath);
+					if (!CreateParentDirectory(StagingPath))
 					{
-						PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), ChildPath.path().string<TCHAR>().c_str());
-						++LocalErrorCount;
 						continue;
 					}
 
-					bool bEqual = std::filesystem::equivalent(RelativeChildPath, HashFileName, Error);
-					if (Error)
+					// A failure, like a mismatching digest above, is not an error, the file is simply transferred from the source like any other.
+					bool bMoved = Copy.bMove && (MoveFileEx(FromPath.string<TCHAR>().c_str(), StagingPath.string<TCHAR>().c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE);
+					if (!bMoved && !BufferFileCopy(FromPath, StagingPath))
 					{
-						PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativeChildPath.string<TCHAR>().c_str(), HashFileName);
-						++LocalErrorCount;
+						DeleteFile(StagingPath.string<TCHAR>().c_str());
 						continue;
 					}
-					if (bEqual)
+
+					Staged.emplace_back(StagedFile{ StagingPath, ToPath, false });
+					StagedCopies.emplace_back(&Copy, bMoved);
+				}
+			}
+
+			CommitStagedFiles(Staged);
+
+			size_t MovedCount = 0;
+			size_t CopiedCount = 0;
+			uintmax_t ReusedBytes = 0;
+			for (size_t i = 0; i < Staged.size(); ++i)
+			{
+				if (!Staged[i].bCommitted)
+				{
+					continue;
+				}
+
+				const LocalCopy& Copy = *StagedCopies[i].first;
+				const bool bMoved = StagedCopies[i].second;
+
+				const uintmax_t Size = std::filesystem::file_size(Staged[i].ToPath, Error);
+				ReusedBytes += Error ? 0 : Size;
+
+				PushLog(bMoved ? _T("File moved from \"%s\" to \"%s\"\n") : _T("File copied from \"%s\" to \"%s\" (local)\n"), (DestPath / *Copy.OldPath).string<TCHAR>().c_str(), Staged[i].ToPath.string<TCHAR>().c_str());
+				EmitFileEvent(bMoved ? "move" : "copy", Staged[i].ToPath, Error ? 0 : Size, 0.0, ERROR_SUCCESS, bMoved ? nullptr : _T("local"));
+				WriteJournalFile(Copy.Entry->RelativePath->string<TCHAR>(), Error ? 0 : Size, *Copy.Entry->Hash, Staged[i].ToPath);
+				SetPlannedDone(Plan, *Copy.Entry);
+
+				if (!bMoved)
+				{
+					++CopiedCount;
+					continue;
+				}
+				++MovedCount;
+
+				// A moved file can leave directories behind that the removal phase never visits, since it only looks at files.
+				for (std::filesystem::path Parent = Copy.OldPath->parent_path(); !Parent.empty(); Parent = Parent.parent_path())
+				{
+					if (std::filesystem::is_directory(SrcPath / Parent, Error) || Error)
 					{
-						continue;
+						break;
+					}
+					const std::filesystem::path EmptyPath = DestPath / Parent;
+					if (!std::filesystem::is_empty(EmptyPath, Error) || Error)
+					{
+						break;
+					}
+					if (!std::filesystem::remove(EmptyPath, Error))
+					{
+						break;
 					}
+					PushLog(_T("%s\n"), EmptyPath.string<TCHAR>().c_str());
+				}
+			}
+			FlushJournal();
+			Phase.SetResult(MovedCount + CopiedCount, ReusedBytes, 0);
 
-					bEqual = std::filesystem::equivalent(RelativeChildPath, LogFileName, Error);
+			PushLog(_T("* %u file(s) moved and %u file(s) copied locally, %.1f MiB not transferred\n"), static_cast<unsigned>(MovedCount), static_cast<unsigned>(CopiedCount), ReusedBytes / 1048576.0);
+		}
+	}
+
+	{
+		PushLog(_T("\n* Remove files or directories that no longer exist on source location:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("remove");
+		
+		size_t NumDeleted = 0;
+
+		SetCurrentDirectory(DestPath.string<TCHAR>().c_str());
+		
+		for (auto const& CurPath : std::filesystem::recursive_directory_iterator{ DestPath })
+		{
+			bool bIsDirectory = std::filesystem::is_directory(CurPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), CurPath.path().string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			if (bIsDirectory)
+			{
+				continue;
+			}
+
+			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, DestPath, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.path().string<TCHAR>().c_str());
+				++LocalErrorCount;
+				continue;
+			}
+			if (CheckIfFileContained(ExcludeForDeletion, RelativePath))
+			{
+				continue;
+			}
+
+			bool bEqual = std::filesystem::equivalent(RelativePath, HashFileName, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativePath.string<TCHAR>().c_str(), HashFileName);
+				++LocalErrorCount;
+				continue;
+			}
+			if (bEqual)
+			{
+				continue;
+			}
+
+			bEqual = std::filesystem::equivalent(RelativePath, LogFileName, Error);
+			if (Error)
+			{
+				PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativePath.string<TCHAR>().c_str(), LogFileName);
+				++LocalErrorCount;
+				continue;
+			}
+			if (bEqual)
+			{
+				continue;
+			}
+
+			const std::basic_string<TCHAR> RelativeString = RelativePath.string<TCHAR>();
+			if ((_tcsicmp(RelativeString.c_str(), JournalFileName) == 0) || IsJournaledStaging(RelativeString) || IsInsideStore(CurPath.path()) || IsEventLogFile(CurPath.path()))
+			{
+				continue;
+			}
+
+			if (!IsPlannedSource(Plan, RelativePath))
+			{
+				const auto StartTime = std::chrono::steady_clock::now();
+				const bool bRemoved = Profiled(ProfileOp::Delete, [&] { return std::filesystem::remove(RelativePath, Error); });
+				const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+				EmitFileEvent("remove", CurPath.path(), 0, Elapsed.count(), Error ? static_cast<unsigned long>(Error.value()) : (bRemoved ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND));
+				if (Error || (!bRemoved))
+				{
+					PushLog(_T("!!Error: Failed to remove \"%s\"\n"), RelativePath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+				}
+				else if (bRemoved)
+				{
+					++NumDeleted;
+					CountMetric(MetricCounter::Deleted, 1, 0);
+					PushLog(_T("%s\n"), RelativePath.string<TCHAR>().c_str());
+				}
+			}
+
+			std::filesystem::path ParentPath = CurPath.path().parent_path();
+			bool bAllowToContinue = false;
+			{
+				bIsDirectory = std::filesystem::is_directory(ParentPath, Error);
+				if (Error)
+				{
+					PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), ParentPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					continue;
+				}
+				if (bIsDirectory)
+				{
+					const bool bIsEmpty = std::filesystem::is_empty(ParentPath, Error);
 					if (Error)
 					{
-						PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativeChildPath.string<TCHAR>().c_str(), LogFileName);
+						PushLog(_T("!!Error: Cannot check if \"%s\" empty\n"), ParentPath.string<TCHAR>().c_str());
 						++LocalErrorCount;
 						continue;
 					}
-					if (bEqual)
+					if (bIsEmpty)
 					{
-						continue;
+						bAllowToContinue = true;
 					}
+				}
+			}
+			
+			if (bAllowToContinue)
+			{
+				const std::filesystem::path RelativeParentPath = std::filesystem::relative(ParentPath, DestPath, Error);
+				if (Error)
+				{
+					PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), ParentPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					continue;
+				}
+				
+				const std::filesystem::path SrcParentPath = SrcPath / RelativeParentPath;
 
-					if (bExclude)
+				const bool bExists = std::filesystem::exists(SrcParentPath, Error);
+				if (Error)
+				{
+					PushLog(_T("!!Error: Cannot check the existence of \"%s\"\n"), SrcParentPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					continue;
+				}
+				if (bExists)
+				{
+					bIsDirectory = std::filesystem::is_directory(SrcParentPath, Error);
+					if (Error)
 					{
-						PathsToExclude.emplace(ChildPath);
+						PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), SrcParentPath.string<TCHAR>().c_str());
+						++LocalErrorCount;
+						continue;
 					}
-					else
+					if (bIsDirectory)
 					{
-						PathsToHashMaking.emplace_back(ChildPath);
+						continue;
 					}
 				}
-			}
-			else
-			{
-				if (bExclude)
+
+				const bool bRemoved = Profiled(ProfileOp::Delete, [&] { return std::filesystem::remove(ParentPath, Error); });
+				if (Error || (!bRemoved))
 				{
-					PathsToExclude.emplace(std::move(CurPath));
+					PushLog(_T("!!Error: Failed to remove \"%s\"\n"), ParentPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
 				}
-				else
+				else if (bRemoved)
 				{
-					PathsToHashMaking.emplace_back(std::move(CurPath));
+					++NumDeleted;
+					CountMetric(MetricCounter::Deleted, 1, 0);
+					PushLog(_T("%s\n"), ParentPath.string<TCHAR>().c_str());
 				}
 			}
 		}
-		if (!ListFile.CloseWithReturn())
-		{
-			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), ListPath.string<TCHAR>().c_str());
-			++LocalErrorCount;
-		}
 
+		Phase.SetResult(NumDeleted, 0, LocalErrorCount);
 		if (LocalErrorCount > 0)
 		{
 			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
 			TotalErrorCount += LocalErrorCount;
 		}
-		if (PathsToHashMaking.empty())
+		if (NumDeleted <= 0)
 		{
-			PushLog(_T("* No file\n"));
+			PushLog(_T("* No removed file or directory\n"));	
 		}
 		else
 		{
-			PushLog(_T("* %u file(s) found\n"), static_cast<unsigned>(PathsToHashMaking.size()));
+			PushLog(_T("* %u file or directory has been removed\n"), static_cast<unsigned>(NumDeleted));
 		}
 	}
 
-	if (PathsToHashMaking.empty())
-	{
-		return;
-	}
-	
 	{
-		PushLog(_T("\n* Following files will be hashed:\n"));
+		PushLog(_T("\n* Collect files which need update:\n"));
+		PhaseScope Phase("collect");
 		
-		for (auto It = PathsToHashMaking.begin(); It != PathsToHashMaking.end();)
+		const size_t TotalCount = SrcHashes.size();
+
+		// Unchanged files were sorted out by the comparison, only the journal of an interrupted update is left to check.
+		size_t ResumedCount = 0;
+		for (auto& Entry : Plan.Entries)
 		{
-			if (PathsToExclude.find(*It) != PathsToExclude.end())
-			{
-				It = PathsToHashMaking.erase(It);
-			}
-			else
+			if (IsPlannedUpdate(Entry) && IsJournaledFile(DestPath, Entry.RelativePath->string<TCHAR>(), *Entry.Hash))
 			{
-				PushLog(_T("%s\n"), It->string<TCHAR>().c_str());
-				++It;
+				SetPlannedDone(Plan, Entry);
+				++ResumedCount;
 			}
 		}
-		
-		PushLog(_T("\n"));
-	}
-
-	{
-		PushLog(_T("\n* Hash making started:\n"));
-		size_t LocalErrorCount = 0;
-		
-		std::basic_string<TCHAR> TmpString;
-		for (const auto& Path : PathsToHashMaking)
+		if (ResumedCount > 0)
 		{
-			RawHash Hash;
-			{
-				FilePtr CurFile(Path, _T("rb"));
-				if (!CurFile)
-				{
-					PushLog(_T("!!Error: Cannot open \"%s\"\n"), Path.string<TCHAR>().c_str());
-					memset(Hash.Raw, 0xff, sizeof(RawHash::Raw));
-					++LocalErrorCount;
-				}
-				else
-				{
-					ConvertToHash(CurFile, Hash);
-				}
-
-				if (!CurFile.CloseWithReturn())
-				{
-					PushLog(_T("!!Error: Failed to close file \"%s\"\n"), Path.string<TCHAR>().c_str());
-					++LocalErrorCount;
-				}
-			}
+			PushLog(_T("* %u file(s) already copied by the interrupted update\n"), static_cast<unsigned>(ResumedCount));
+		}
 
-			TmpString = std::filesystem::relative(Path, SrcPath, Error).string<TCHAR>();
-			if (Error)
-			{
-				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), Path.string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
-			}
-			
-			TmpString += _T("\n");
-			TmpString += ConvertToString(Hash);
-			TmpString += _T("\n");
+		const size_t UpdateCount = GetPlannedUpdateCount(Plan);
+		Phase.SetResult(UpdateCount, 0, 0);
 
-			_fputts(TmpString.c_str(), HashFile.Get());
-		}
-		if (!HashFile.CloseWithReturn())
+		if (UpdateCount <= 0)
 		{
-			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), HashPath.string<TCHAR>().c_str());
-			++LocalErrorCount;
+			PushLog(_T("* No files need update\n"));	
 		}
-
-		if (LocalErrorCount > 0)
+		else
 		{
-			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
-			TotalErrorCount += LocalErrorCount;
+			PushLog(_T("* (%u/%u) file need update\n"), static_cast<unsigned>(UpdateCount), static_cast<unsigned>(TotalCount));
 		}
-		PushLog(_T("* Done\n"));
-	}
-
-	if (TotalErrorCount > 0)
-	{
-		PushLog(_T("\n* %u error occurred in total\n"), static_cast<unsigned>(TotalErrorCount));
-	}
-	else
-	{
-		PushLog(_T("\n* All tasks done successfully\n"));
 	}
-}
-
-void CopyPackage(const std::filesystem::path& SrcPath, const std::filesystem::path& DestPath)
-{
-	std::error_code Error;
 	
-	const std::filesystem::path ListPath(SrcPath / ListFileName);
-	FilePtr ListFile(ListPath, _T("rt, ccs=UTF-8"));
-	if (!ListFile)
+	if (GetPlannedUpdateCount(Plan) > 0)
 	{
-		PushLog(_T("!!Error: Cannot open \"%s\"\n"), ListPath.string<TCHAR>().c_str());
-		return;
-	}
+		PushLog(_T("\n* Update started:\n"));
+		std::atomic<size_t> LocalErrorCount = 0;
+		PhaseScope Phase("update");
 
-	const std::filesystem::path SrcHashPath(SrcPath / HashFileName);
-	FilePtr SrcHashFile(SrcHashPath, _T("rt, ccs=UTF-8"));
-	if (!SrcHashFile)
-	{
-		PushLog(_T("!!Error: Cannot open \"%s\"\n"), SrcHashPath.string<TCHAR>().c_str());
-		return;
-	}
-	
-	const std::filesystem::path DestHashPath(DestPath / HashFileName);
-	FilePtr DestHashFile(DestHashPath, _T("rt, ccs=UTF-8"));
+		std::atomic<size_t> MethodCounts[static_cast<size_t>(CopyMethod::Buffered) + 1] = {};
+		std::atomic<uintmax_t> MethodBytes[static_cast<size_t>(CopyMethod::Buffered) + 1] = {};
+		std::atomic<uintmax_t> HoleBytes = 0;
 
-	size_t TotalErrorCount = 0;
+		if (!OpenJournal(DestPath))
+		{
+			PushLog(_T("* Journal unavailable, an interrupted update will start over\n"));
+		}
 
-	std::deque<std::filesystem::path> ExcludeForDeletion;
-	{
-		PushLog(_T("\n* Read list for excluding from update:\n"));
-		size_t LocalErrorCount = 0;
-		
-		SetCurrentDirectory(SrcPath.string<TCHAR>().c_str());
-		
-		while (!feof(ListFile.Get()))
+		std::vector<CopyJob> Jobs;
+		Jobs.reserve(GetPlannedUpdateCount(Plan));
+		uintmax_t TotalBytes = 0;
+		for (const auto& Entry : Plan.Entries)
 		{
-			bool bExclude;
-			std::filesystem::path CurPath(ReadFileLine(ListFile, bExclude));
-			if (CurPath.empty())
-			{
-				continue;
-			}
-			if (!bExclude)
-			{
-				continue;
-			}
-			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, SrcPath, Error);
-			if (Error)
+			if (!IsPlannedUpdate(Entry))
 			{
-				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
-				++LocalErrorCount;
 				continue;
 			}
-			
-			ExcludeForDeletion.emplace_back(std::move(RelativePath));
-		}
-		if (!ListFile.CloseWithReturn())
-		{
-			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), ListPath.string<TCHAR>().c_str());
-			++LocalErrorCount;
-		}
 
-		if (ExcludeForDeletion.empty())
-		{
-			PushLog(_T("* No files or directories\n"));
-		}
-		else
-		{
-			PushLog(_T("* %u files or directories found\n"), static_cast<unsigned>(ExcludeForDeletion.size()));
+			const uintmax_t Size = std::filesystem::file_size(SrcPath / *Entry.RelativePath, Error);
+			Jobs.emplace_back(CopyJob{ *Entry.RelativePath, Error ? 0 : Size, Entry.Hash, false });
+			TotalBytes += Jobs.back().Size;
 		}
-	}
 
-	PathMap<RawHash> DestHashes;
-	if (DestHashFile)
-	{
-		PushLog(_T("\n* Read destination file hash:\n"));
-		size_t LocalErrorCount = 0;
-		
-		SetCurrentDirectory(DestPath.string<TCHAR>().c_str());
+		ProgressScope Progress(_T("update"), Jobs.size(), TotalBytes);
 
-		while (!feof(DestHashFile.Get()))
 		{
-			std::filesystem::path CurPath(ReadFileLine(DestHashFile));
-			if (CurPath.empty())
+			std::vector<std::filesystem::path> RelativePaths;
+			RelativePaths.reserve(Jobs.size());
+			for (const auto& Job : Jobs)
 			{
-				continue;
-			}
-			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, DestPath, Error);
-			if (Error)
-			{
-				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
+				RelativePaths.emplace_back(Job.RelativePath);
 			}
-			if (CheckIfFileContained(ExcludeForDeletion, RelativePath))
+			CreateDirectorySkeleton(DestPath, RelativePaths);
+		}
+
+		// With deduplication only the first file of each content comes from the source, the others are created from it at the destination.
+		std::vector<CopyJob> DuplicateJobs;
+		DigestMap<std::filesystem::path> CommittedContent;
+		std::mutex CommittedMutex;
+		if (__hidden_Option::Dedup != DedupMode::None)
+		{
+			std::unordered_set<RawHash, DigestHasher, DigestEqualTo> SeenContent;
+			std::vector<CopyJob> UniqueJobs;
+			UniqueJobs.reserve(Jobs.size());
+			for (auto& Job : Jobs)
 			{
-				continue;
+				if ((Job.Size == 0) || SeenContent.emplace(*Job.Hash).second)
+				{
+					UniqueJobs.emplace_back(std::move(Job));
+				}
+				else
+				{
+					DuplicateJobs.emplace_back(std::move(Job));
+				}
 			}
+			Jobs = std::move(UniqueJobs);
 
-			RawHash CurHash;
-			if (!ConvertToHash(ReadFileStringLine(DestHashFile), CurHash))
+			if (!DuplicateJobs.empty())
 			{
-				PushLog(_T("!!Error: Invalid hash format \"%s\"\n"), CurPath.string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
+				PushLog(_T("* %u duplicate file(s) will be created from their first copy\n"), static_cast<unsigned>(DuplicateJobs.size()));
 			}
-
-			DestHashes.emplace(std::move(RelativePath), std::move(CurHash));
 		}
-		if (!DestHashFile.CloseWithReturn())
+		auto RecordContent = [&](const CopyJob& Job, const std::filesystem::path& ToPath)
 		{
-			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), DestHashPath.string<TCHAR>().c_str());
-			++LocalErrorCount;
-		}
+			if (DuplicateJobs.empty())
+			{
+				return;
+			}
 
-		if (LocalErrorCount > 0)
-		{
-			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
-			TotalErrorCount += LocalErrorCount;
-		}
-		if (DestHashes.empty())
-		{
-			PushLog(_T("* No file hash\n"));	
-		}
-		else
+			std::lock_guard<std::mutex> Lock(CommittedMutex);
+			CommittedContent.emplace(*Job.Hash, ToPath);
+		};
+
+		auto ResolvePaths = [&](const CopyJob& Job, std::filesystem::path& FromPath, std::filesystem::path& ToPath) -> bool
 		{
-			PushLog(_T("* %u file hash found\n"), static_cast<unsigned>(DestHashes.size()));
-		}
-	}
+			std::error_code Error;
 
-	PathMap<RawHash> SrcHashes;
-	{
-		PushLog(_T("\n* Read source file hash:\n"));
-		size_t LocalErrorCount = 0;
-		
-		SetCurrentDirectory(SrcPath.string<TCHAR>().c_str());
+			FromPath = SrcPath / Job.RelativePath;
+			ToPath = DestPath / Job.RelativePath;
 
-		while (!feof(SrcHashFile.Get()))
-		{
-			std::filesystem::path CurPath(ReadFileLine(SrcHashFile));
-			if (CurPath.empty())
+			bool bIsSymbolic = std::filesystem::is_symlink(FromPath, Error);
+			if (Error)
 			{
-				continue;
+				PushLog(_T("!!Error: Failed to check if \"%s\" symbolic link\n"), FromPath.string<TCHAR>().c_str());
+				++LocalErrorCount;
+				return false;
 			}
-			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, SrcPath, Error);
+			if (bIsSymbolic)
+			{
+				std::filesystem::path OrgPath = std::filesystem::read_symlink(FromPath, Error);
+				if (Error)
+				{
+					PushLog(_T("!!Error: Failed to read symbolic link \"%s\"\n"), FromPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					return false;
+				}
+			
+				PushLog(LogLevel::Trace, _T("Symbolic link conversion: \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), OrgPath.string<TCHAR>().c_str());
+				FromPath = std::move(OrgPath);
+			}
+
+			const bool bExists = std::filesystem::exists(ToPath, Error);
 			if (Error)
 			{
-				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.string<TCHAR>().c_str());
+				PushLog(_T("!!Error: Cannot check the existence of \"%s\"\n"), ToPath.string<TCHAR>().c_str());
 				++LocalErrorCount;
-				continue;
+				return false;
 			}
-			if (CheckIfFileContained(ExcludeForDeletion, RelativePath))
+			if (bExists)
 			{
-				continue;
+				bIsSymbolic = std::filesystem::is_symlink(ToPath, Error);
+				if (Error)
+				{
+					PushLog(_T("!!Error: Failed to check if \"%s\" symbolic link\n"), ToPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+					return false;
+				}
+				if (bIsSymbolic)
+				{
+					std::filesystem::path OrgPath = std::filesystem::read_symlink(ToPath, Error);
+					if (Error)
+					{
+						PushLog(_T("!!Error: Failed to read symbolic link \"%s\"\n"), ToPath.string<TCHAR>().c_str());
+						++LocalErrorCount;
+						return false;
+					}
+
+					PushLog(LogLevel::Trace, _T("Symbolic link conversion: \"%s\" to \"%s\"\n"), ToPath.string<TCHAR>().c_str(), OrgPath.string<TCHAR>().c_str());
+					ToPath = std::move(OrgPath);
+				}
 			}
+		
+			return true;
+		};
 
-			RawHash CurHash;
-			if (!ConvertToHash(ReadFileStringLine(SrcHashFile), CurHash))
+		// A digest mismatch means the source changed or a read went wrong, so the copy is retried from scratch.
+		auto VerifiedCopy = [](const CopyJob& Job, const std::filesystem::path& FromPath, const std::filesystem::path& StagingPath, CopyResult& Result) -> bool
+		{
+			const RawHash* ExpectedHash = __hidden_Option::bVerify ? Job.Hash : nullptr;
+			for (size_t Attempt = 0;; ++Attempt)
 			{
-				PushLog(_T("!!Error: Invalid hash format \"%s\"\n"), CurPath.string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
+				if (BufferFileCopy(FromPath, StagingPath, Result, ExpectedHash))
+				{
+					return true;
+				}
+				if (!Result.bDigestMismatch || (Attempt >= __hidden_Option::VerifyRetry))
+				{
+					return false;
+				}
+				PushLog(_T("Retrying \"%s\" (%u/%u)\n"), FromPath.string<TCHAR>().c_str(), static_cast<unsigned>(Attempt + 1), static_cast<unsigned>(__hidden_Option::VerifyRetry));
 			}
+		};
 
-			SrcHashes.emplace(std::move(RelativePath), std::move(CurHash));
-		}
-		if (!SrcHashFile.CloseWithReturn())
+		// Large files leave checkpoints in the journal, a restarted update continues them from the last one.
+		auto ResumableCopy = [](const CopyJob& Job, const std::filesystem::path& FromPath, const std::filesystem::path& StagingPath, CopyResult& Result) -> bool
 		{
-			PushLog(_T("!!Error: Failed to close file \"%s\"\n"), SrcHashPath.string<TCHAR>().c_str());
-			++LocalErrorCount;
-		}
+			const RawHash* ExpectedHash = __hidden_Option::bVerify ? Job.Hash : nullptr;
+			const std::basic_string<TCHAR> RelativePath = Job.RelativePath.string<TCHAR>();
 
-		if (LocalErrorCount > 0)
-		{
-			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
-			TotalErrorCount += LocalErrorCount;
-		}
-		if (SrcHashes.empty())
-		{
-			PushLog(_T("* No file hash\n"));	
-		}
-		else
-		{
-			PushLog(_T("* %u file hash found\n"), static_cast<unsigned>(SrcHashes.size()));
-		}
-	}
+			Result = CopyResult{ CopyMethod::Checkpoint, 0, false };
+			if (!CreateParentDirectory(StagingPath))
+			{
+				return false;
+			}
 
-	{
-		PushLog(_T("\n* Remove files or directories that no longer exist on source location:\n"));
-		size_t LocalErrorCount = 0;
-		
-		size_t NumDeleted = 0;
+			ThrottleFile();
 
-		SetCurrentDirectory(DestPath.string<TCHAR>().c_str());
-		
-		for (auto const& CurPath : std::filesystem::recursive_directory_iterator{ DestPath })
-		{
-			bool bIsDirectory = std::filesystem::is_directory(CurPath, Error);
-			if (Error)
+			uintmax_t Offset = GetJournalOffset(RelativePath, *Job.Hash, StagingPath);
+			if ((Offset == 0) && !ExpectedHash && BlockCloneFileCopy(FromPath, StagingPath))
 			{
-				PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), CurPath.path().string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
+				Result.Method = CopyMethod::BlockClone;
+				return true;
 			}
-			if (bIsDirectory)
+			if (Offset > 0)
 			{
-				continue;
+				PushLog(_T("Resuming \"%s\" at %.1f MiB\n"), FromPath.string<TCHAR>().c_str(), Offset / 1048576.0);
 			}
 
-			std::filesystem::path RelativePath = std::filesystem::relative(CurPath, DestPath, Error);
-			if (Error)
-			{
-				PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), CurPath.path().string<TCHAR>().c_str());
-				++LocalErrorCount;
-				continue;
-			}
-			if (CheckIfFileContained(ExcludeForDeletion, RelativePath))
+			for (size_t Attempt = 0;; ++Attempt)
 			{
-				continue;
+				sha512_ctx CTX;
+				if (!CheckpointFileCopy(FromPath, StagingPath, Offset, ExpectedHash ? &CTX : nullptr, [&](uintmax_t Committed)
+				{
+					WriteJournalCheckpoint(RelativePath, Committed, *Job.Hash);
+				}))
+				{
+					return false;
+				}
+				if (!ExpectedHash)
+				{
+					return true;
+				}
+
+				RawHash Actual;
+				sha512_final(&CTX, Actual.Raw);
+				if (IsSameDigest(Actual, *ExpectedHash))
+				{
+					Result.bDigestMismatch = false;
+					return true;
+				}
+
+				PushLog(_T("!!Error: Digest mismatch while copying \"%s\"\n"), FromPath.string<TCHAR>().c_str());
+				Result.bDigestMismatch = true;
+				if (Attempt >= __hidden_Option::VerifyRetry)
+				{
+					return false;
+				}
+				PushLog(_T("Retrying \"%s\" (%u/%u)\n"), FromPath.string<TCHAR>().c_str(), static_cast<unsigned>(Attempt + 1), static_cast<unsigned>(__hidden_Option::VerifyRetry));
+				Offset = 0;
 			}
+		};
 
-			bool bEqual = std::filesystem::equivalent(RelativePath, HashFileName, Error);
-			if (Error)
+		// Content a kept version already brought to this volume is linked from the store instead of being transferred again.
+		if (IsStoreEnabled())
+		{
+			std::unordered_set<const CopyJob*> FailedJobs;
+			std::vector<StagedFile> Staged;
+			std::vector<std::pair<CopyJob*, CopyMethod>> StagedJobs;
+			for (auto& Job : Jobs)
 			{
-				PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativePath.string<TCHAR>().c_str(), HashFileName);
-				++LocalErrorCount;
-				continue;
+				const std::filesystem::path ObjectPath = MakeObjectPath(*Job.Hash);
+				const bool bExists = std::filesystem::exists(ObjectPath, Error);
+				if (Error || !bExists)
+				{
+					continue;
+				}
+
+				// An object changed through a deployed file is dropped, so this update stores the right content again.
+				if (!IsIntactObject(*Job.Hash))
+				{
+					PushLog(_T("Object \"%s\" was changed in place, dropped from the store\n"), ObjectPath.string<TCHAR>().c_str());
+					DeleteFile(ObjectPath.string<TCHAR>().c_str());
+					continue;
+				}
+
+				// ResolvePaths already counted the error, the regular copy must not report it a second time.
+				std::filesystem::path FromPath;
+				std::filesystem::path ToPath;
+				if (!ResolvePaths(Job, FromPath, ToPath))
+				{
+					FailedJobs.emplace(&Job);
+					continue;
+				}
+
+				const std::filesystem::path StagingPath = MakeStagingPath(ToPath);
+				CopyResult Result;
+				if (!CreateParentDirectory(StagingPath) || !LinkOrCopyFile(ObjectPath, StagingPath, Result))
+				{
+					DeleteFile(StagingPath.string<TCHAR>().c_str());
+					continue;
+				}
+
+				Staged.emplace_back(StagedFile{ StagingPath, std::move(ToPath), false });
+				StagedJobs.emplace_back(&Job, Result.Method);
 			}
-			if (bEqual)
+
+			CommitStagedFiles(Staged);
+
+			for (size_t i = 0; i < Staged.size(); ++i)
 			{
-				continue;
+				if (!Staged[i].bCommitted)
+				{
+					continue;
+				}
+
+				CopyJob& Job = *StagedJobs[i].first;
+				const CopyMethod Method = StagedJobs[i].second;
+				PushLog(_T("File copied from \"%s\" to \"%s\" (%s)\n"), MakeObjectPath(*Job.Hash).string<TCHAR>().c_str(), Staged[i].ToPath.string<TCHAR>().c_str(), ConvertToString(Method));
+				++MethodCounts[static_cast<size_t>(Method)];
+				MethodBytes[static_cast<size_t>(Method)] += Job.Size;
+				Job.bSucceeded = true;
+				WriteJournalFile(Job.RelativePath.string<TCHAR>(), Job.Size, *Job.Hash, Staged[i].ToPath);
+				RecordContent(Job, Staged[i].ToPath);
+				AddProgress(1, Job.Size);
+				CountMetric(MetricCounter::Copied, 1, Job.Size);
+				EmitFileEvent("copy", Staged[i].ToPath, Job.Size, 0.0, ERROR_SUCCESS, ConvertToString(Method));
 			}
+			FlushJournal();
 
-			bEqual = std::filesystem::equivalent(RelativePath, LogFileName, Error);
-			if (Error)
+			Jobs.erase(std::remove_if(Jobs.begin(), Jobs.end(), [&FailedJobs](const CopyJob& Job)
 			{
-				PushLog(_T("!!Error: Failed to check if \"%s\" is \"%s\"\n"), RelativePath.string<TCHAR>().c_str(), LogFileName);
-				++LocalErrorCount;
-				continue;
-			}
-			if (bEqual)
+				return Job.bSucceeded || (FailedJobs.find(&Job) != FailedJobs.end());
+			}), Jobs.end());
+		}
+
+		{
+			std::unordered_map<std::basic_string<TCHAR>, CopyJob*> JobsByKey;
+			for (auto& Job : Jobs)
 			{
-				continue;
+				JobsByKey.emplace(__hidden_Diff::MakeKey(Job.RelativePath), &Job);
 			}
 
-			if (SrcHashes.find(RelativePath) == SrcHashes.end())
+			std::unordered_set<const CopyJob*> FailedJobs;
+			size_t UnpackedCount = 0;
+			uintmax_t UnpackedBytes = 0;
+			const auto StartTime = std::chrono::steady_clock::now();
+
+			std::vector<PackIndexEntry> Index;
+			std::basic_string<TCHAR> EntryPath;
+			std::vector<unsigned char> Data;
+			RawHash EntryHash;
+			for (size_t PackIndex = 0;; ++PackIndex)
 			{
-				const bool bRemoved = std::filesystem::remove(RelativePath, Error);
-				if (Error || (!bRemoved))
+				const std::filesystem::path PackPath = MakePackPath(SrcPath, PackIndex);
 				{
-					PushLog(_T("!!Error: Failed to remove \"%s\"\n"), RelativePath.string<TCHAR>().c_str());
+					FilePtr IndexFile(PackPath, _T("rb"));
+					if (!IndexFile)
+					{
+						break;
+					}
+					if (!ReadPackHeader(IndexFile) || !ReadPackIndex(IndexFile, Index))
+					{
+						PushLog(_T("!!Error: Invalid pack file \"%s\"\n"), PackPath.string<TCHAR>().c_str());
+						++LocalErrorCount;
+						continue;
+					}
+				}
+
+				// Only the entries still needed are read, in file order. A pack without any is not read at all.
+				std::vector<std::pair<unsigned long long, CopyJob*>> Needed;
+				for (const auto& Entry : Index)
+				{
+					auto Found = JobsByKey.find(__hidden_Diff::MakeKey(Entry.RelativePath));
+					if (Found != JobsByKey.end())
+					{
+						Needed.emplace_back(Entry.Offset, Found->second);
+					}
+				}
+				if (Needed.empty())
+				{
+					continue;
+				}
+				std::sort(Needed.begin(), Needed.end(), [](const auto& Lhs, const auto& Rhs) { return Lhs.first < Rhs.first; });
+
+				// A mostly needed pack streams front to back through one large stdio buffer, passing over the entries in between.
+				// A few entries are sought out directly instead, since every seek drops the buffer. The lease outlives the stream,
+				// which uses the buffer until it is closed.
+				const bool bSequential = (Needed.size() * 2) >= Index.size();
+				BufferLease ReadBuffer;
+				FilePtr PackFile(PackPath, _T("rb"));
+				if (!PackFile)
+				{
+					PushLog(_T("!!Error: Cannot open \"%s\"\n"), PackPath.string<TCHAR>().c_str());
 					++LocalErrorCount;
+					continue;
 				}
-				else if (bRemoved)
+				if (bSequential && ReadBuffer)
 				{
-					++NumDeleted;
-					PushLog(_T("%s\n"), RelativePath.string<TCHAR>().c_str());
+					setvbuf(PackFile.Get(), reinterpret_cast<char*>(ReadBuffer.Get()), _IOFBF, ReadBuffer.Size());
+				}
+
+				std::vector<StagedFile> Staged;
+				std::vector<CopyJob*> StagedJobs;
+				bool bDamaged = !ReadPackHeader(PackFile);
+				for (const auto& Wanted : Needed)
+				{
+					if (bDamaged)
+					{
+						break;
+					}
+
+					const long long Offset = static_cast<long long>(Wanted.first);
+					if (bSequential)
+					{
+						while (!bDamaged && (_ftelli64(PackFile.Get()) < Offset))
+						{
+							bDamaged = !ReadPackEntry(PackFile, EntryPath, Data, EntryHash);
+						}
+					}
+					else
+					{
+						bDamaged = _fseeki64(PackFile.Get(), Offset, SEEK_SET) != 0;
+					}
+					if (bDamaged || (_ftelli64(PackFile.Get()) != Offset) || !ReadPackEntry(PackFile, EntryPath, Data, EntryHash))
+					{
+						bDamaged = true;
+						break;
+					}
+					ThrottleRead(Data.size());
+
+					CopyJob& Job = *Wanted.second;
+
+					// A stale entry is left to the regular copy.
+					if (!IsSameDigest(EntryHash, *Job.Hash))
+					{
+						continue;
+					}
+					if (__hidden_Option::bVerify)
+					{
+						RawHash Actual;
+						sha512_ctx CTX;
+						sha512_init(&CTX);
+						sha512_update(&CTX, Data.data(), static_cast<unsigned int>(Data.size()));
+						sha512_final(&CTX, Actual.Raw);
+						if (!IsSameDigest(Actual, EntryHash))
+						{
+							continue;
+						}
+					}
+
+					// ResolvePaths already counted the error, the regular copy must not report it a second time.
+					std::filesystem::path FromPath;
+					std::filesystem::path ToPath;
+					if (!ResolvePaths(Job, FromPath, ToPath))
+					{
+						FailedJobs.emplace(&Job);
+						continue;
+					}
+					if (!CreateParentDirectory(ToPath))
+					{
+						continue;
+					}
+
+					ThrottleFile();
+					ThrottleWrite(Data.size());
+
+					const std::filesystem::path StagingPath = MakeStagingPath(ToPath);
+					{
+						HandlePtr ToFile(StagingPath, GENERIC_WRITE, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN);
+						DWORD Wrote = 0;
+						if (!ToFile || !WriteFile(ToFile.Get(), Data.data(), static_cast<DWORD>(Data.size()), &Wrote, nullptr) || (Wrote != Data.size()) || !ToFile.CloseWithReturn())
+						{
+							ToFile = HandlePtr();
+							DeleteFile(StagingPath.string<TCHAR>().c_str());
+							continue;
+						}
+					}
+
+					Staged.emplace_back(StagedFile{ StagingPath, std::move(ToPath), false });
+					StagedJobs.emplace_back(&Job);
+				}
+				if (bDamaged)
+				{
+					PushLog(_T("!!Error: Invalid pack file \"%s\"\n"), PackPath.string<TCHAR>().c_str());
+					++LocalErrorCount;
+				}
+
+				CommitStagedFiles(Staged);
+
+				for (size_t i = 0; i < Staged.size(); ++i)
+				{
+					if (!Staged[i].bCommitted)
+					{
+						continue;
+					}
+
+					PushLog(_T("File copied from \"%s\" to \"%s\" (%s)\n"), PackPath.string<TCHAR>().c_str(), Staged[i].ToPath.string<TCHAR>().c_str(), ConvertToString(CopyMethod::Pack));
+					++MethodCounts[static_cast<size_t>(CopyMethod::Pack)];
+					MethodBytes[static_cast<size_t>(CopyMethod::Pack)] += StagedJobs[i]->Size;
+					StagedJobs[i]->bSucceeded = true;
+					WriteJournalFile(StagedJobs[i]->RelativePath.string<TCHAR>(), StagedJobs[i]->Size, *StagedJobs[i]->Hash, Staged[i].ToPath);
+					RecordContent(*StagedJobs[i], Staged[i].ToPath);
+					AddProgress(1, StagedJobs[i]->Size);
+					CountMetric(MetricCounter::Copied, 1, StagedJobs[i]->Size);
+					EmitFileEvent("copy", Staged[i].ToPath, StagedJobs[i]->Size, 0.0, ERROR_SUCCESS, ConvertToString(CopyMethod::Pack));
+
+					++UnpackedCount;
+					UnpackedBytes += StagedJobs[i]->Size;
 				}
+				FlushJournal();
 			}
 
-			std::filesystem::path ParentPath = CurPath.path().parent_path();
-			bool bAllowToContinue = false;
+			if (UnpackedCount > 0)
 			{
-				bIsDirectory = std::filesystem::is_directory(ParentPath, Error);
-				if (Error)
+				const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+				PushLog(_T("* %u file(s), %.1f MiB unpacked in %.2f s\n"), static_cast<unsigned>(UnpackedCount), UnpackedBytes / 1048576.0, Elapsed.count());
+			}
+			if ((UnpackedCount > 0) || !FailedJobs.empty())
+			{
+				Jobs.erase(std::remove_if(Jobs.begin(), Jobs.end(), [&FailedJobs](const CopyJob& Job)
 				{
-					PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), ParentPath.string<TCHAR>().c_str());
-					++LocalErrorCount;
-					continue;
+					return Job.bSucceeded || (FailedJobs.find(&Job) != FailedJobs.end());
+				}), Jobs.end());
+			}
+		}
+
+		auto CopyBatch = [&](std::span<CopyJob> Batch)
+		{
+			TraceScope Trace("batch", "copy");
+
+			struct PendingCopy
+			{
+				CopyJob* Job;
+				std::filesystem::path FromPath;
+				CopyResult Result;
+				double Seconds;
+			};
+
+			std::vector<PendingCopy> Pendings;
+			std::vector<StagedFile> Staged;
+			Pendings.reserve(Batch.size());
+			Staged.reserve(Batch.size());
+
+			if ((__hidden_Option::Backend == IOBackend::Async) && (Batch.size() > 1))
+			{
+				std::vector<AsyncCopyRequest> Requests;
+				Requests.reserve(Batch.size());
+				for (auto& Job : Batch)
+				{
+					std::filesystem::path FromPath;
+					std::filesystem::path ToPath;
+					if (ResolvePaths(Job, FromPath, ToPath))
+					{
+						Requests.emplace_back(AsyncCopyRequest{ FromPath, MakeStagingPath(ToPath), __hidden_Option::bVerify ? Job.Hash : nullptr, false, false });
+						Pendings.emplace_back(PendingCopy{ &Job, std::move(FromPath), CopyResult{ CopyMethod::Async, 0 }, 0.0 });
+						Staged.emplace_back(StagedFile{ Requests.back().ToPath, std::move(ToPath), false });
+					}
 				}
-				if (bIsDirectory)
+
+				const auto StartTime = std::chrono::steady_clock::now();
+				AsyncFileCopy(Requests);
+				const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+
+				for (size_t i = 0; i < Requests.size(); ++i)
 				{
-					const bool bIsEmpty = std::filesystem::is_empty(ParentPath, Error);
-					if (Error)
+					// Requests overlap, so each file is charged an even share of the batch.
+					Pendings[i].Seconds = Elapsed.count() / Requests.size();
+
+					if (!Requests[i].bSucceeded && Requests[i].bDigestMismatch && VerifiedCopy(*Pendings[i].Job, Requests[i].FromPath, Requests[i].ToPath, Pendings[i].Result))
 					{
-						PushLog(_T("!!Error: Cannot check if \"%s\" empty\n"), ParentPath.string<TCHAR>().c_str());
+						continue;
+					}
+					if (!Requests[i].bSucceeded)
+					{
+						EmitFileEvent("copy", Staged[i].ToPath, Pendings[i].Job->Size, Pendings[i].Seconds, ERROR_GEN_FAILURE);
+						PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), Requests[i].FromPath.string<TCHAR>().c_str(), Staged[i].ToPath.string<TCHAR>().c_str());
+						DeleteFile(Requests[i].ToPath.string<TCHAR>().c_str());
 						++LocalErrorCount;
+						Pendings[i].Job = nullptr;
+					}
+				}
+			}
+			else
+			{
+				for (auto& Job : Batch)
+				{
+					std::filesystem::path FromPath;
+					std::filesystem::path ToPath;
+					if (!ResolvePaths(Job, FromPath, ToPath))
+					{
 						continue;
 					}
-					if (bIsEmpty)
+
+					const std::filesystem::path StagingPath = MakeStagingPath(ToPath);
+
+					// Checkpoints need positioned buffered writes, sparse sources and direct I/O sizes keep their own paths instead.
+					const DWORD Attributes = GetFileAttributes(FromPath.string<TCHAR>().c_str());
+					const bool bSparse = (Attributes != INVALID_FILE_ATTRIBUTES) && (Attributes & FILE_ATTRIBUTE_SPARSE_FILE);
+					const bool bDirect = (__hidden_Option::DirectIOSize > 0) && (Job.Size >= __hidden_Option::DirectIOSize);
+					const bool bResumable = IsJournalOpen() && (__hidden_Option::CheckpointSize > 0) && (Job.Size >= __hidden_Option::CheckpointSize) && !bSparse && !bDirect;
+
+					TraceScope Trace("copy", "file", ToPath);
+
+					const auto StartTime = std::chrono::steady_clock::now();
+					CopyResult Result;
+					const bool bCopied = bResumable ? ResumableCopy(Job, FromPath, StagingPath, Result) : VerifiedCopy(Job, FromPath, StagingPath, Result);
+					const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - StartTime;
+					if (!bCopied)
 					{
-						bAllowToContinue = true;
+						EmitFileEvent("copy", ToPath, Job.Size, Elapsed.count(), GetLastError());
+						PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+						DeleteFile(StagingPath.string<TCHAR>().c_str());
+						++LocalErrorCount;
+						continue;
 					}
+
+					Pendings.emplace_back(PendingCopy{ &Job, std::move(FromPath), Result, Elapsed.count() });
+					Staged.emplace_back(StagedFile{ StagingPath, std::move(ToPath), false });
 				}
 			}
-			
-			if (bAllowToContinue)
+
+			// Failed copies must not take part in the commit.
+			for (size_t i = Pendings.size(); i-- > 0;)
 			{
-				const std::filesystem::path RelativeParentPath = std::filesystem::relative(ParentPath, DestPath, Error);
-				if (Error)
+				if (!Pendings[i].Job)
 				{
-					PushLog(_T("!!Error: Failed to calculate relative path of \"%s\"\n"), ParentPath.string<TCHAR>().c_str());
+					Pendings.erase(Pendings.begin() + i);
+					Staged.erase(Staged.begin() + i);
+				}
+			}
+
+			CommitStagedFiles(Staged);
+
+			for (size_t i = 0; i < Pendings.size(); ++i)
+			{
+				if (!Staged[i].bCommitted)
+				{
+					EmitFileEvent("copy", Staged[i].ToPath, Pendings[i].Job->Size, Pendings[i].Seconds, ERROR_GEN_FAILURE);
 					++LocalErrorCount;
 					continue;
 				}
-				
-				const std::filesystem::path SrcParentPath = SrcPath / RelativeParentPath;
 
-				const bool bExists = std::filesystem::exists(SrcParentPath, Error);
-				if (Error)
+				const PendingCopy& Pending = Pendings[i];
+				PushLog(_T("File copied from \"%s\" to \"%s\" (%s)\n"), Pending.FromPath.string<TCHAR>().c_str(), Staged[i].ToPath.string<TCHAR>().c_str(), ConvertToString(Pending.Result.Method));
+				++MethodCounts[static_cast<size_t>(Pending.Result.Method)];
+				MethodBytes[static_cast<size_t>(Pending.Result.Method)] += Pending.Job->Size;
+				HoleBytes += Pending.Result.HoleBytes;
+				Pending.Job->bSucceeded = true;
+				WriteJournalFile(Pending.Job->RelativePath.string<TCHAR>(), Pending.Job->Size, *Pending.Job->Hash, Staged[i].ToPath);
+				RecordContent(*Pending.Job, Staged[i].ToPath);
+				AddProgress(1, Pending.Job->Size);
+				CountMetric(MetricCounter::Copied, 1, Pending.Job->Size);
+				EmitFileEvent("copy", Staged[i].ToPath, Pending.Job->Size, Pending.Seconds, ERROR_SUCCESS, ConvertToString(Pending.Result.Method));
+			}
+			FlushJournal();
+		};
+
+		CopyStat Stat = ScheduleCopyJobs(Jobs, CopyBatch);
+
+		if (!DuplicateJobs.empty())
+		{
+			std::vector<CopyJob> FallbackJobs;
+			std::vector<StagedFile> Staged;
+			std::vector<std::pair<CopyJob*, CopyMethod>> StagedJobs;
+			for (auto& Job : DuplicateJobs)
+			{
+				// Content whose first copy failed is fetched from the source after all.
+				auto Found = CommittedContent.find(*Job.Hash);
+				if (Found == CommittedContent.end())
 				{
-					PushLog(_T("!!Error: Cannot check the existence of \"%s\"\n"), SrcParentPath.string<TCHAR>().c_str());
-					++LocalErrorCount;
+					FallbackJobs.emplace_back(Job);
 					continue;
 				}
-				if (bExists)
+
+				std::filesystem::path FromPath;
+				std::filesystem::path ToPath;
+				if (!ResolvePaths(Job, FromPath, ToPath))
+				{
+					continue;
+				}
+
+				const std::filesystem::path StagingPath = MakeStagingPath(ToPath);
+				if (!CreateParentDirectory(StagingPath))
 				{
-					bIsDirectory = std::filesystem::is_directory(SrcParentPath, Error);
-					if (Error)
-					{
-						PushLog(_T("!!Error: Cannot check if \"%s\" directory\n"), SrcParentPath.string<TCHAR>().c_str());
-						++LocalErrorCount;
-						continue;
-					}
-					if (bIsDirectory)
-					{
-						continue;
-					}
+					FallbackJobs.emplace_back(Job);
+					continue;
 				}
 
-				const bool bRemoved = std::filesystem::remove(ParentPath, Error);
-				if (Error || (!bRemoved))
+				CopyResult Result;
+				const bool bCreated = (__hidden_Option::Dedup == DedupMode::Link) ? LinkOrCopyFile(Found->second, StagingPath, Result) : BufferFileCopy(Found->second, StagingPath, Result);
+				if (!bCreated)
 				{
-					PushLog(_T("!!Error: Failed to remove \"%s\"\n"), ParentPath.string<TCHAR>().c_str());
-					++LocalErrorCount;
+					DeleteFile(StagingPath.string<TCHAR>().c_str());
+					FallbackJobs.emplace_back(Job);
+					continue;
 				}
-				else if (bRemoved)
+
+				Staged.emplace_back(StagedFile{ StagingPath, std::move(ToPath), false });
+				StagedJobs.emplace_back(&Job, Result.Method);
+			}
+
+			CommitStagedFiles(Staged);
+
+			for (size_t i = 0; i < Staged.size(); ++i)
+			{
+				CopyJob& Job = *StagedJobs[i].first;
+				if (!Staged[i].bCommitted)
 				{
-					++NumDeleted;
-					PushLog(_T("%s\n"), ParentPath.string<TCHAR>().c_str());
+					FallbackJobs.emplace_back(Job);
+					continue;
 				}
+
+				const CopyMethod Method = StagedJobs[i].second;
+				PushLog(_T("File copied from \"%s\" to \"%s\" (%s)\n"), CommittedContent.find(*Job.Hash)->second.string<TCHAR>().c_str(), Staged[i].ToPath.string<TCHAR>().c_str(), ConvertToString(Method));
+				++MethodCounts[static_cast<size_t>(Method)];
+				MethodBytes[static_cast<size_t>(Method)] += Job.Size;
+				WriteJournalFile(Job.RelativePath.string<TCHAR>(), Job.Size, *Job.Hash, Staged[i].ToPath);
+				AddProgress(1, Job.Size);
+				CountMetric(MetricCounter::Copied, 1, Job.Size);
+				EmitFileEvent("copy", Staged[i].ToPath, Job.Size, 0.0, ERROR_SUCCESS, ConvertToString(Method));
+			}
+			FlushJournal();
+
+			if (!FallbackJobs.empty())
+			{
+				const CopyStat FallbackStat = ScheduleCopyJobs(FallbackJobs, CopyBatch);
+				Stat.FileCount += FallbackStat.FileCount;
+				Stat.ByteCount += FallbackStat.ByteCount;
+				Stat.Seconds += FallbackStat.Seconds;
 			}
 		}
 
+		size_t UpdatedCount = 0;
+		uintmax_t UpdatedBytes = 0;
+		for (size_t i = 0; i < std::size(MethodCounts); ++i)
+		{
+			UpdatedCount += MethodCounts[i];
+			UpdatedBytes += MethodBytes[i];
+		}
+		Phase.SetResult(UpdatedCount, UpdatedBytes, LocalErrorCount);
+
 		if (LocalErrorCount > 0)
 		{
 			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
 			TotalErrorCount += LocalErrorCount;
 		}
-		if (NumDeleted <= 0)
+		for (size_t i = static_cast<size_t>(CopyMethod::BlockClone); i < std::size(MethodCounts); ++i)
 		{
-			PushLog(_T("* No removed file or directory\n"));	
+			if (MethodCounts[i] > 0)
+			{
+				PushLog(_T("* %u file(s), %.1f MiB copied by %s\n"), static_cast<unsigned>(MethodCounts[i]), MethodBytes[i] / 1048576.0, ConvertToString(static_cast<CopyMethod>(i)));
+				RecordCopyMethodMetric(ConvertToString(static_cast<CopyMethod>(i)), MethodCounts[i], MethodBytes[i]);
+			}
 		}
-		else
+		if (HoleBytes > 0)
 		{
-			PushLog(_T("* %u file or directory has been removed\n"), static_cast<unsigned>(NumDeleted));
+			PushLog(_T("* %.1f MiB of sparse file holes skipped\n"), HoleBytes / 1048576.0);
+		}
+		if (MethodCounts[static_cast<size_t>(CopyMethod::Direct)] > 0)
+		{
+			PushLog(_T("* %.1f MiB bypassed the system file cache\n"), MethodBytes[static_cast<size_t>(CopyMethod::Direct)] / 1048576.0);
 		}
+		PushLog(_T("* %u file(s), %.1f MiB copied in %.2f s (%.1f MiB/s)\n"), static_cast<unsigned>(Stat.FileCount), Stat.ByteCount / 1048576.0, Stat.Seconds, (Stat.Seconds > 0.0) ? (Stat.ByteCount / 1048576.0 / Stat.Seconds) : 0.0);
+		PushLog(_T("* Done\n"));
 	}
 
+	if (TotalErrorCount <= 0)
 	{
-		PushLog(_T("\n* Collect files which need update:\n"));
+		PushLog(_T("\n* Update hash list:\n"));
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("update_manifest");
 		
-		const size_t TotalCount = SrcHashes.size();
+		const std::filesystem::path FromPath = SrcPath / HashFileName;
+		const std::filesystem::path ToPath = DestPath / HashFileName;
 
-		if (!DestHashes.empty())
+		std::vector<StagedFile> Staged{ StagedFile{ MakeStagingPath(ToPath), ToPath, false } };
+		
+		if (!BufferFileCopy(FromPath, Staged.front().StagingPath))
+		{
+			PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			DeleteFile(Staged.front().StagingPath.string<TCHAR>().c_str());
+			++LocalErrorCount;
+		}
+		else
 		{
-			std::vector<std::tuple<PathMap<RawHash>::iterator, bool>> HashesToCompare;
-			HashesToCompare.reserve(TotalCount);
-			for (auto It = SrcHashes.begin(), Et = SrcHashes.end(); It != Et; ++It)
+			// The manifest is committed last. With a volume flush this also persists the renames of every earlier batch.
+			CommitStagedFiles(Staged);
+			if (!Staged.front().bCommitted)
 			{
-				HashesToCompare.emplace_back(std::make_tuple(It, false));
+				++LocalErrorCount;
 			}
-			concurrency::parallel_for_each(HashesToCompare.begin(), HashesToCompare.end(), [&DestHashes](decltype(HashesToCompare)::value_type& Wrapped)
+			else
 			{
-				auto Found = DestHashes.find(std::get<0>(Wrapped)->first);
-				if (Found == DestHashes.end())
-				{
-					return;
-				}
+				PushLog(_T("File copied from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			}
+		}
 
-				if (memcmp(std::get<0>(Wrapped)->second.Raw, Found->second.Raw, sizeof(RawHash::Raw)) == 0)
-				{
-					std::get<1>(Wrapped) = true;
-				}
-			});
-			for (const auto& Wrapped : HashesToCompare)
-			{
-				if (!std::get<1>(Wrapped))
-				{
-					continue;
-				}
+		Phase.SetResult(Staged.front().bCommitted ? 1 : 0, 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		PushLog(_T("* Done\n"));
+	}
 
-				SrcHashes.erase(std::get<0>(Wrapped));
-			}
+	if ((TotalErrorCount <= 0) && IsStoreEnabled())
+	{
+		PushLog(_T("\n* Update version store:\n"));
+		PhaseScope Phase("update_store");
+
+		const size_t LocalErrorCount = UpdateVersionStore(DestPath);
+		Phase.SetResult(0, 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
 		}
+		PushLog(_T("* Done\n"));
+	}
 
-		const size_t UpdateCount = SrcHashes.size();
+	TotalPhase.SetResult(GetPlannedUpdateCount(Plan), 0, TotalErrorCount);
+	// Only a committed manifest makes the journal obsolete, after any error it is kept for the next run.
+	CloseJournal(DestPath, TotalErrorCount <= 0);
 
-		if (UpdateCount <= 0)
+	if (TotalErrorCount > 0)
+	{
+		PushLog(_T("\n* %u error occurred in total\n"), static_cast<unsigned>(TotalErrorCount));
+	}
+	else
+	{
+		PushLog(_T("\n* All tasks done successfully\n"));
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void RollbackPackage(const std::filesystem::path& DestPath, const std::basic_string<TCHAR>& Version)
+{
+	PhaseScope TotalPhase("total");
+	std::error_code Error;
+
+	if (!IsStoreEnabled())
+	{
+		PushLog(_T("!!Error: Rollback needs the version store given by \"--store\"\n"));
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+
+	const std::filesystem::path VersionPath = MakeVersionPath(Version);
+	__hidden_Store::Manifest Entries;
+	if (!ReadManifest(VersionPath, Entries))
+	{
+		PushLog(_T("!!Error: Cannot read version \"%s\"\n"), Version.c_str());
+		PushLog(_T("\n* Available versions:\n"));
+		for (const auto& Available : ListVersions())
 		{
-			PushLog(_T("* No files need update\n"));	
+			PushLog(LogLevel::Summary, _T("%s\n"), Available.c_str());
 		}
-		else
+		TotalPhase.SetResult(0, 0, 1);
+		return;
+	}
+
+	size_t TotalErrorCount = 0;
+
+	// The live manifest is only committed by an update without errors, while a failed update has still committed files one by one.
+	// It therefore only names files to remove, together with the files the journal of a failed update lists. What stays is decided
+	// per file.
+	std::unordered_set<std::basic_string<TCHAR>> VersionKeys;
+	for (const auto& Entry : Entries)
+	{
+		VersionKeys.emplace(__hidden_Diff::MakeKey(Entry.first));
+	}
+
+	std::unordered_map<std::basic_string<TCHAR>, std::basic_string<TCHAR>> Removals;
+	std::vector<std::basic_string<TCHAR>> PartPaths;
+	{
+		std::vector<std::basic_string<TCHAR>> Candidates;
+		__hidden_Store::Manifest LiveEntries;
+		ReadManifest(DestPath / HashFileName, LiveEntries);
+		for (auto& Entry : LiveEntries)
 		{
-			PushLog(_T("* (%u/%u) file need update\n"), static_cast<unsigned>(UpdateCount), static_cast<unsigned>(TotalCount));
+			Candidates.emplace_back(std::move(Entry.first));
+		}
+		if (ReadJournal(DestPath) > 0)
+		{
+			ListJournaledPaths(Candidates, PartPaths);
+		}
+
+		for (auto& Candidate : Candidates)
+		{
+			std::basic_string<TCHAR> Key = __hidden_Diff::MakeKey(Candidate);
+			if (VersionKeys.find(Key) == VersionKeys.end())
+			{
+				Removals.emplace(std::move(Key), std::move(Candidate));
+			}
 		}
 	}
-	
-	if (!SrcHashes.empty())
+
 	{
-		PushLog(_T("\n* Update started:\n"));
+		PushLog(_T("\n* Relink files of version \"%s\":\n"), Version.c_str());
 		size_t LocalErrorCount = 0;
+		PhaseScope Phase("relink");
 
-		for (const auto& Wrapped : SrcHashes)
+		std::vector<StagedFile> Staged;
+		for (const auto& Entry : Entries)
 		{
-			std::filesystem::path FromPath = SrcPath / Wrapped.first;
-			std::filesystem::path ToPath = DestPath / Wrapped.first;
+			const std::filesystem::path ToPath = DestPath / Entry.first;
+			const std::filesystem::path ObjectPath = MakeObjectPath(Entry.second);
 
-			bool bIsSymbolic = std::filesystem::is_symlink(FromPath, Error);
-			if (Error)
+			if (!IsIntactObject(Entry.second))
 			{
-				PushLog(_T("!!Error: Failed to check if \"%s\" symbolic link\n"), FromPath.string<TCHAR>().c_str());
+				PushLog(_T("!!Error: Object \"%s\" of \"%s\" is missing or was changed in place\n"), ObjectPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
 				++LocalErrorCount;
 				continue;
 			}
-			if (bIsSymbolic)
+			if (IsSameFile(ToPath, ObjectPath))
 			{
-				std::filesystem::path OrgPath = std::filesystem::read_symlink(FromPath, Error);
-				if (Error)
-				{
-					PushLog(_T("!!Error: Failed to read symbolic link \"%s\"\n"), FromPath.string<TCHAR>().c_str());
-					++LocalErrorCount;
-					continue;
-				}
-				
-				PushLog(_T("Symbolic link conversion: \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), OrgPath.string<TCHAR>().c_str());
-				FromPath = std::move(OrgPath);
+				continue;
 			}
 
-			const bool bExists = std::filesystem::exists(ToPath, Error);
-			if (Error)
+			const std::filesystem::path StagingPath = MakeStagingPath(ToPath);
+			CopyResult Result;
+			if (!CreateParentDirectory(StagingPath) || !LinkOrCopyFile(ObjectPath, StagingPath, Result))
 			{
-				PushLog(_T("!!Error: Cannot check the existence of \"%s\"\n"), ToPath.string<TCHAR>().c_str());
+				PushLog(_T("!!Error: Failed to link \"%s\" to \"%s\"\n"), ObjectPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+				DeleteFile(StagingPath.string<TCHAR>().c_str());
 				++LocalErrorCount;
 				continue;
 			}
-			if (bExists)
-			{
-				bIsSymbolic = std::filesystem::is_symlink(ToPath, Error);
-				if (Error)
-				{
-					PushLog(_T("!!Error: Failed to check if \"%s\" symbolic link\n"), ToPath.string<TCHAR>().c_str());
-					++LocalErrorCount;
-					continue;
-				}
-				if (bIsSymbolic)
-				{
-					std::filesystem::path OrgPath = std::filesystem::read_symlink(ToPath, Error);
-					if (Error)
-					{
-						PushLog(_T("!!Error: Failed to read symbolic link \"%s\"\n"), ToPath.string<TCHAR>().c_str());
-						++LocalErrorCount;
-						continue;
-					}
 
-					PushLog(_T("Symbolic link conversion: \"%s\" to \"%s\"\n"), ToPath.string<TCHAR>().c_str(), OrgPath.string<TCHAR>().c_str());
-					ToPath = std::move(OrgPath);
-				}
+			Staged.emplace_back(StagedFile{ StagingPath, ToPath, false });
+		}
+
+		CommitStagedFiles(Staged);
+
+		size_t LinkedCount = 0;
+		for (const auto& File : Staged)
+		{
+			if (!File.bCommitted)
+			{
+				++LocalErrorCount;
+				continue;
 			}
-			
-			if (!BufferFileCopy(FromPath, ToPath))
+			PushLog(_T("%s\n"), File.ToPath.string<TCHAR>().c_str());
+			++LinkedCount;
+		}
+
+		Phase.SetResult(LinkedCount, 0, LocalErrorCount);
+		if (LocalErrorCount > 0)
+		{
+			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
+			TotalErrorCount += LocalErrorCount;
+		}
+		PushLog(_T("* %u file(s) relinked\n"), static_cast<unsigned>(LinkedCount));
+	}
+
+	{
+		PushLog(_T("\n* Remove files that are not part of version \"%s\":\n"), Version.c_str());
+		size_t LocalErrorCount = 0;
+		PhaseScope Phase("remove");
+
+		// Checkpointed staging files of the failed update are dropped along with it.
+		for (const auto& PartPath : PartPaths)
+		{
+			DeleteFile(MakeStagingPath(DestPath / PartPath).string<TCHAR>().c_str());
+		}
+
+		size_t NumDeleted = 0;
+		for (const auto& Entry : Removals)
+		{
+			const std::filesystem::path RemovePath = DestPath / Entry.second;
+			const bool bRemoved = Profiled(ProfileOp::Delete, [&] { return std::filesystem::remove(RemovePath, Error); });
+			if (Error)
 			{
-				PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+				PushLog(_T("!!Error: Failed to remove \"%s\"\n"), RemovePath.string<TCHAR>().c_str());
 				++LocalErrorCount;
 				continue;
 			}
-			else
+			if (!bRemoved)
 			{
-				PushLog(_T("File copied from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+				continue;
+			}
+			PushLog(_T("%s\n"), RemovePath.string<TCHAR>().c_str());
+			++NumDeleted;
+			CountMetric(MetricCounter::Deleted, 1, 0);
+
+			for (std::filesystem::path Parent = std::filesystem::path(Entry.second).parent_path(); !Parent.empty(); Parent = Parent.parent_path())
+			{
+				const std::filesystem::path EmptyPath = DestPath / Parent;
+				if (!std::filesystem::is_empty(EmptyPath, Error) || Error)
+				{
+					break;
+				}
+				if (!std::filesystem::remove(EmptyPath, Error))
+				{
+					break;
+				}
+				PushLog(_T("%s\n"), EmptyPath.string<TCHAR>().c_str());
 			}
 		}
 
+		Phase.SetResult(NumDeleted, 0, LocalErrorCount);
 		if (LocalErrorCount > 0)
 		{
 			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
 			TotalErrorCount += LocalErrorCount;
 		}
-		PushLog(_T("* Done\n"));
+		if (NumDeleted <= 0)
+		{
+			PushLog(_T("* No removed file\n"));
+		}
+		else
+		{
+			PushLog(_T("* %u file has been removed\n"), static_cast<unsigned>(NumDeleted));
+		}
 	}
 
 	if (TotalErrorCount <= 0)
 	{
 		PushLog(_T("\n* Update hash list:\n"));
 		size_t LocalErrorCount = 0;
-		
-		const std::filesystem::path FromPath = SrcPath / HashFileName;
+		PhaseScope Phase("update_manifest");
+
 		const std::filesystem::path ToPath = DestPath / HashFileName;
-		
-		if (!BufferFileCopy(FromPath, ToPath))
+
+		std::vector<StagedFile> Staged{ StagedFile{ MakeStagingPath(ToPath), ToPath, false } };
+		if (!BufferFileCopy(VersionPath, Staged.front().StagingPath))
 		{
-			PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			PushLog(_T("!!Error: Failed to copy from \"%s\" to \"%s\"\n"), VersionPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			DeleteFile(Staged.front().StagingPath.string<TCHAR>().c_str());
 			++LocalErrorCount;
 		}
 		else
 		{
-			PushLog(_T("File copied from \"%s\" to \"%s\"\n"), FromPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			CommitStagedFiles(Staged);
+			if (!Staged.front().bCommitted)
+			{
+				++LocalErrorCount;
+			}
+			else
+			{
+				PushLog(_T("File copied from \"%s\" to \"%s\"\n"), VersionPath.string<TCHAR>().c_str(), ToPath.string<TCHAR>().c_str());
+			}
 		}
 
+		// The journal of an interrupted update describes files that were replaced or removed above.
+		std::filesystem::remove(DestPath / JournalFileName, Error);
+
+		Phase.SetResult(Staged.front().bCommitted ? 1 : 0, 0, LocalErrorCount);
 		if (LocalErrorCount > 0)
 		{
 			PushLog(_T("* %u error occurred\n"), static_cast<unsigned>(LocalErrorCount));
@@ -1211,6 +7088,7 @@ void CopyPackage(const std::filesystem::path& SrcPath, const std::filesystem::pa
 		PushLog(_T("* Done\n"));
 	}
 
+	TotalPhase.SetResult(Entries.size(), 0, TotalErrorCount);
 	if (TotalErrorCount > 0)
 	{
 		PushLog(_T("\n* %u error occurred in total\n"), static_cast<unsigned>(TotalErrorCount));
@@ -1230,6 +7108,23 @@ int _tmain(int Argc, TCHAR* Argv[])
 	std::error_code Error;
 
 	std::locale::global(std::locale(".UTF-8"));
+
+	std::vector<TCHAR*> Args;
+	for (int i = 0; i < Argc; ++i)
+	{
+		if ((i > 0) && (_tcsncmp(Argv[i], _T("--"), 2) == 0))
+		{
+			if (!ParseOption(Argv[i]))
+			{
+				_tprintf_s(_T("!!Error: Invalid option \"%s\"\n"), Argv[i]);
+				return -1;
+			}
+			continue;
+		}
+		Args.push_back(Argv[i]);
+	}
+	Argc = static_cast<int>(Args.size());
+	Argv = Args.data();
 	
 	switch(Argc)
 	{
@@ -1260,9 +7155,40 @@ int _tmain(int Argc, TCHAR* Argv[])
 			_tprintf_s(_T("!!Error: Cannot open/create \"%s\"\n"), LogPath.string<TCHAR>().c_str());
 			return -1;
 		}
+		if (!OpenEventLog())
+		{
+			PushLog(_T("!!Error: Cannot open/create \"%s\"\n"), __hidden_Option::EventPath.string<TCHAR>().c_str());
+		}
 
-		CreateHash(SrcPath);
+		SetupBufferPool();
+		SetupThrottle();
+		StartMetrics(__hidden_Option::RollbackVersion.empty() ? "hash" : "rollback");
 
+		// With "--rollback" the single directory is the destination to relink.
+		if (!__hidden_Option::RollbackVersion.empty())
+		{
+			RollbackPackage(SrcPath, __hidden_Option::RollbackVersion);
+		}
+		else
+		{
+			CreateHash(SrcPath);
+		}
+
+		ReleaseBufferPool();
+		if (!StopMetrics())
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::MetricsPath.string<TCHAR>().c_str());
+		}
+		if (!WriteTrace())
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::TracePath.string<TCHAR>().c_str());
+		}
+		PrintProfile();
+		if (!WriteProfile())
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::ProfilePath.string<TCHAR>().c_str());
+		}
+		CloseEventLog();
 		CloseLog();
 	}
 	break;
@@ -1306,6 +7232,11 @@ int _tmain(int Argc, TCHAR* Argv[])
 			_tprintf_s(_T("!!Error: No such directory \"%s\"\n"), DestPath.string<TCHAR>().c_str());
 			return -1;
 		}
+		if (!__hidden_Option::PlanPath.empty() && !__hidden_Option::ApplyPath.empty())
+		{
+			_tprintf_s(_T("!!Error: \"--plan\" and \"--apply\" cannot be used together\n"));
+			return -1;
+		}
 
 		std::filesystem::path LogPath(DestPath / LogFileName);
 		if(!CreateLog(LogPath))
@@ -1313,9 +7244,32 @@ int _tmain(int Argc, TCHAR* Argv[])
 			_tprintf_s(_T("!!Error: Cannot open/create \"%s\"\n"), LogPath.string<TCHAR>().c_str());
 			return -1;
 		}
+		if (!OpenEventLog())
+		{
+			PushLog(_T("!!Error: Cannot open/create \"%s\"\n"), __hidden_Option::EventPath.string<TCHAR>().c_str());
+		}
+
+		SetupBufferPool();
+		SetupThrottle();
+		StartMetrics(!__hidden_Option::PlanPath.empty() ? "plan" : (!__hidden_Option::ApplyPath.empty() ? "apply" : "update"));
 
 		CopyPackage(SrcPath, DestPath);
 
+		ReleaseBufferPool();
+		if (!StopMetrics())
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::MetricsPath.string<TCHAR>().c_str());
+		}
+		if (!WriteTrace())
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::TracePath.string<TCHAR>().c_str());
+		}
+		PrintProfile();
+		if (!WriteProfile())
+		{
+			PushLog(_T("!!Error: Cannot write \"%s\"\n"), __hidden_Option::ProfilePath.string<TCHAR>().c_str());
+		}
+		CloseEventLog();
 		CloseLog();
 	}	
 	break;
@@ -1324,6 +7278,42 @@ int _tmain(int Argc, TCHAR* Argv[])
 	{
 		_tprintf_s(_T("exe [src]: Read copy list named \"%s\"\n"), ListFileName);
 		_tprintf_s(_T("exe [src] [dest]: Copy \"Src\" into \"Dest\" based on \"%s\" which defined at \"Src\". By comparing hash value, only different file will be updated.\n"), ListFileName);
+		_tprintf_s(_T("exe --store=[path] --rollback=[version] [dest]: Relink \"Dest\" to a version kept in the store.\n"));
+		_tprintf_s(_T("exe --plan=[path] [src] [dest]: Compare \"Src\" with \"Dest\" and only write the operations, their byte totals and an estimated cost to a plan file.\n"));
+		_tprintf_s(_T("exe --apply=[path] [src] [dest]: Update \"Dest\" from \"Src\" by a plan file instead of comparing, on any destination in the state the plan was made from.\n"));
+		_tprintf_s(_T("\nOptions:\n"));
+		_tprintf_s(_T("--console-level=[error|summary|file|trace]: Messages printed to the console, below \"file\" a progress count stands in for file messages (default summary)\n"));
+		_tprintf_s(_T("--log-level=[error|summary|file|trace]: Messages written to the log file (default file)\n"));
+		_tprintf_s(_T("--events=[path]: Append JSON lines records of every phase, with timings, counts and errors, to this file\n"));
+		_tprintf_s(_T("--events-files: Also record every hashed, copied and removed file in the \"--events\" file\n"));
+		_tprintf_s(_T("--progress=[seconds]: Interval of the progress line with throughput and ETA while hashing and updating (default 1, 0 disables)\n"));
+		_tprintf_s(_T("--profile: Time file system operations and print their latency distribution at the end of the run\n"));
+		_tprintf_s(_T("--profile-json=[path]: Also write the latency histograms of \"--profile\" to this file as JSON\n"));
+		_tprintf_s(_T("--trace=[path]: Record a timeline of phases, directory scans, hashes and copies per thread and write it to this file in Chrome trace event format\n"));
+		_tprintf_s(_T("--trace-spans=[count]: Spans \"--trace\" holds in memory until the end of the run, later ones are dropped and counted (default 256K, 0 unlimited)\n"));
+		_tprintf_s(_T("--metrics=[path]: Write Prometheus text format metrics of the run to this file, for the node_exporter textfile collector\n"));
+		_tprintf_s(_T("--metrics-interval=[seconds]: Interval at which \"--metrics\" is rewritten during the run (default 15, 0 writes it only at the end)\n"));
+		_tprintf_s(_T("--buffer-budget=[size]: Upper bound of memory used by copy and hash buffers (default 256M)\n"));
+		_tprintf_s(_T("--buffer-size=[size]: Size of a single copy or hash buffer (default 16M, at most 2G)\n"));
+		_tprintf_s(_T("--large-pages: Back buffers with large pages when the process holds SeLockMemoryPrivilege\n"));
+		_tprintf_s(_T("--io-backend=[sync|async]: \"async\" hashes files and copies small file batches through an I/O completion port (default sync)\n"));
+		_tprintf_s(_T("--direct-io=[size]: Copy files of at least this size without the system file cache (default 0, disabled)\n"));
+		_tprintf_s(_T("--sync=[none|batch]: \"batch\" flushes each batch of staged files to disk before moving them into place (default batch)\n"));
+		_tprintf_s(_T("--read-limit=[size]: Bytes read per second over all workers (default 0, unlimited)\n"));
+		_tprintf_s(_T("--write-limit=[size]: Bytes written per second over all workers (default 0, unlimited)\n"));
+		_tprintf_s(_T("--file-limit=[count]: Files copied or hashed per second over all workers (default 0, unlimited)\n"));
+		_tprintf_s(_T("--throttle-file=[path]: Control file re-read during the run, with lines \"read=[size]\", \"write=[size]\" and \"files=[count]\"\n"));
+		_tprintf_s(_T("--pack=[size]: While hashing, also stream files below this size into sequential pack files that copies read instead (default 0, disabled)\n"));
+		_tprintf_s(_T("--pack-size=[size]: Maximum payload of a single pack file (default 64M)\n"));
+		_tprintf_s(_T("--verify: Hash the data while copying and compare it with the source manifest before committing\n"));
+		_tprintf_s(_T("--verify-retry=[count]: Number of retries after a digest mismatch (default 2)\n"));
+		_tprintf_s(_T("--checkpoint=[size]: Files of at least this size record their progress every this many bytes, so an interrupted update resumes them, except sparse files and \"--direct-io\" copies (default 0, disabled)\n"));
+		_tprintf_s(_T("--dedup=[none|clone|link]: Copy identical files once and create the others at the destination, \"clone\" as block clones or local copies, \"link\" as hard links sharing one file (default none)\n"));
+		_tprintf_s(_T("--store=[path]: Keep every deployed version in a content addressed store on the destination volume, deployed files become hard links into it. Anything writing into a deployed file in place also changes the stored object, which is then refused on rollback\n"));
+		_tprintf_s(_T("--keep-versions=[count]: Number of versions kept in the store (default 5)\n"));
+		_tprintf_s(_T("--copy-workers=[count]: Number of files copied concurrently (default: number of logical processors)\n"));
+		_tprintf_s(_T("--small-file=[size]: Files below this size are copied in batches (default 64K)\n"));
+		_tprintf_s(_T("--small-batch=[count]: Number of small files handed to a worker at once (default 32)\n"));
 	}
 	break;
 	}